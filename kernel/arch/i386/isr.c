@@ -1,6 +1,9 @@
 #include <stdio.h>
 
 #include <interrupts.h>
+#include <memory.h>
+
+#define PAGE_FAULT 14
 
 extern void isr0();
 extern void isr1();
@@ -71,6 +74,19 @@ void isr_init() {
 }
 
 void isr_handler(registers_t regs) {
+   if (regs.int_num == PAGE_FAULT) {
+      uint32_t fault_addr;
+      __asm__ volatile ("mov %%cr2, %0" : "=r"(fault_addr));
+
+      // Demand paged memory is backed on first touch
+      if (vmm_page_fault(fault_addr, regs.err_code)) return;
+
+      printf("\npage fault at 0x%x, error code 0x%x\n", fault_addr, regs.err_code);
+
+      // Returning would retry the faulting instruction forever
+      for (;;) __asm__ volatile ("cli; hlt");
+   }
+
    printf("\nrecieved interrupt: 0x%x\n", regs.int_num);
 
    __asm__ volatile ("hlt");
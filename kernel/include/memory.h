@@ -5,38 +5,123 @@
 
 #define PAGE_SIZE 4096
 
+#ifdef CONFIG_PAE
+typedef uint64_t phys_addr_t;
+#define MAX_PHYS_LOG2 34
+#define PHYS_LIMIT 0x400000000ULL // Usable physical memory ends at 16 GiB, its frame descriptors take 128 MiB of the linear map
+#else
+typedef uint32_t phys_addr_t;
+#define MAX_PHYS_LOG2 32
+#define PHYS_LIMIT 0xFFFFF000 // Usable physical memory ends at the last page below 4 GiB
+#endif
+
 /***************** Physical memory manager, buddy allocator ******************/
-#define MEM_BLOCK_LOG2 27 // TODO: discover memory instead of using hard coded value
 #define MAX_BLOCK_LOG2 22
 #define MIN_BLOCK_LOG2 12
 #define MAX_ORDER (MAX_BLOCK_LOG2 - MIN_BLOCK_LOG2)
 
-#define TOTAL_TREE_NODES ((1 << (MEM_BLOCK_LOG2 - MIN_BLOCK_LOG2 + 1)) - 1)
-#define TRUNCATED_TREE_NODES ((1 << (MEM_BLOCK_LOG2 - MAX_BLOCK_LOG2)) - 1)
-#define TREE_NODES (TOTAL_TREE_NODES - TRUNCATED_TREE_NODES)
-#define TREE_WORDS ((TREE_NODES + 31) / 32)
+#define LINEAR_MAP_LIMIT 0x30000000 // Physical memory above this is not linearly mapped at 0xC0000000
+#define BOOT_MAP_END 0x1000000      // Physical memory mapped by boot.S with 4 MiB pages
 
-struct buddy_block {
-    struct buddy_block *prev;
-    struct buddy_block *next;
-};
-typedef struct buddy_block buddy_block_t;
+#define PAGEBLOCK_PAGES (1 << MAX_ORDER) // Pages per pageblock, the unit of mobility grouping
+#define ZERO_POOL_PAGES 32 // Pre-zeroed pages kept ready per migrate type for page tables and zero-filled memory
+
+typedef enum {
+    MIGRATE_UNMOVABLE,   // Page tables, allocator metadata, physically addressed buffers
+    MIGRATE_MOVABLE,     // Data only reached through its virtual mapping
+    MIGRATE_RECLAIMABLE, // Slab pages that can be given back when caches shrink
+    MIGRATE_TYPES
+} MIGRATE_TYPE;
+
+#define TREE_NODES(log2) (((1 << ((log2) - MIN_BLOCK_LOG2 + 1)) - 1) - TRUNCATED_TREE_NODES(log2))
+#define TRUNCATED_TREE_NODES(log2) ((1 << ((log2) - MAX_BLOCK_LOG2)) - 1)
+#define TREE_WORDS(log2) ((TREE_NODES(log2) + 31) / 32)
+
+typedef enum {
+    PG_RESERVED = 0x1,  // Never handed to the buddy allocator
+    PG_BUDDY    = 0x2,  // First page of a free buddy block
+    PG_SLAB     = 0x4,  // Backs objects of a slab cache
+    PG_LRU      = 0x8,  // Tracked by the LRU cache
+    PG_ACTIVE   = 0x10, // On the active LRU list
+    PG_MOVABLE  = 0x20, // Only reached through its mapping, can be migrated
+    PG_ISOLATED = 0x40, // Held by compaction until its pageblock is evacuated
+    PG_PAGE_TABLE = 0x80 // Page table created by the VMM, freed when it becomes empty
+} PAGE_FLAGS;
+
+// Page frame descriptor, one per 4 KiB page of physical memory
+struct page {
+    struct page *prev; // Free list linkage
+    struct page *next;
+    struct slab *slab; // Owning slab of a PG_SLAB page
+    struct cache *cache; // Owning cache of a PG_SLAB page
+    struct lru_page *lru; // LRU cache node of a PG_LRU page
+    uint32_t private; // Page count of a pmm_alloc_exact region, live entries of a PG_PAGE_TABLE page
+    uint32_t mapping; // Virtual address of a PG_MOVABLE page
+    uint16_t refcount;
+    uint8_t order; // Order of the block starting at this page
+    uint8_t flags;
+} __attribute__((aligned(32)));
+typedef struct page page_t;
 
 struct buddy {
-    uint32_t base;
-    uint32_t size; // Total bytes of memory available
-    uint32_t free;
+    phys_addr_t base;
+    phys_addr_t size; // Total bytes of memory available
+    phys_addr_t free;
 
-    uint32_t bit_tree[TREE_WORDS];
-    buddy_block_t *free_lists[MAX_ORDER + 1];
+    uint8_t tree_log2; // log2 of the memory span covered by the bit tree
+    uint32_t *bit_tree;
+    page_t *pages; // Frame descriptors, indexed by page frame number
+    uint32_t num_pages;
+    uint8_t *pageblock_types; // Migrate type of each pageblock
+    page_t *free_lists[MIGRATE_TYPES][MAX_ORDER + 1];
+    uint32_t free_mask[MIGRATE_TYPES]; // Bit n is set while free_lists[type][n] is non-empty
+    uint32_t nr_free[MIGRATE_TYPES][MAX_ORDER + 1];
+
+    phys_addr_t zero_pool[MIGRATE_TYPES][ZERO_POOL_PAGES]; // Allocated pages that have already been zeroed
+    uint32_t zero_count[MIGRATE_TYPES];
 };
 typedef struct buddy buddy_t;extern buddy_t pmm;
 
 uint32_t pmm_init(uint32_t, uint32_t);
-uint32_t *pmm_malloc(uint32_t);
-void pmm_free(uint32_t, uint32_t);
+phys_addr_t pmm_malloc(uint32_t, uint8_t);
+void pmm_free(phys_addr_t);
+uint32_t pmm_alloc_bulk(uint32_t, phys_addr_t *, uint8_t);
+void pmm_free_bulk(uint32_t, phys_addr_t *);
+phys_addr_t pmm_alloc_exact(uint32_t);
+void pmm_free_exact(phys_addr_t);
+page_t *pmm_get_page(phys_addr_t);
+phys_addr_t pmm_page_address(page_t *);
+void pmm_dump();
+void pmm_benchmark(uint32_t);
+uint8_t pmm_compact_background();
+phys_addr_t pmm_alloc_zeroed(uint8_t);
+void pmm_zero_idle();
+uint32_t pmm_low_watermark();
+uint32_t pmm_high_watermark();
 
 /************************** Virtual memory manager ***************************/
+#ifdef CONFIG_PAE
+// PAE paging: 64-bit entries, a PDPT of four page directories of 512 entries
+typedef uint64_t pte_t;
+#define PT_ENTRIES 512
+#define PD_ENTRIES 2048 // The four page directories, contiguous in the recursive mapping
+#define PD_PAGES 4
+#define PDE_SHIFT 21
+#define PTE_ADDR 0x000FFFFFFFFFF000ULL // Physical address in a paging entry
+#define MAX_ADDRESS_SPACES 128 // PDPTs kept in the kernel image
+#else
+typedef uint32_t pte_t;
+#define PT_ENTRIES 1024
+#define PD_ENTRIES 1024
+#define PD_PAGES 1
+#define PDE_SHIFT 22
+#define PTE_ADDR 0xFFFFF000 // Physical address in a paging entry
+#endif
+
+#define PDE_INDEX(addr) ((addr) >> PDE_SHIFT)
+#define PTE_INDEX(addr) (((addr) >> 12) & (PT_ENTRIES - 1))
+#define KERNEL_PDE PDE_INDEX(0xC0000000) // First page directory entry of the kernel half
+
 typedef enum {
     PTE_PRESENT         = 0x1,
     PTE_READ_WRITE      = 0x2,
@@ -47,6 +132,7 @@ typedef enum {
     PTE_DIRTY           = 0x40,
     PTE_PAT             = 0x80,
     PTE_GLOBAL          = 0x100,
+    PTE_COW             = 0x200, // Write protected page shared by mm_clone, copied on write
     PTE_AVAILABLE       = 0xE00,
     PTE_FRAME           = 0xFFFFF000
 } PAGE_TABLE_FLAGS;
@@ -58,31 +144,133 @@ typedef enum {
     PDE_WRITETHROUGH    = 0x8,
     PDE_CACHE_DISABLE   = 0x10,
     PDE_ACCESSED        = 0x20,
-    PDE_PAGE_SIZE       = 0x40,
+    PDE_DIRTY           = 0x40, // 4 MiB pages only
+    PDE_PAGE_SIZE       = 0x80,
+    PDE_GLOBAL          = 0x100, // 4 MiB pages only
+    PDE_ALLOCATED       = 0x200, // Large page backing vmm_malloc memory, freed when unmapped
     PDE_AVAILABLE       = 0xF00,
     PDE_FRAME           = 0xFFFFF000
 } PAGE_DIRECTORY_FLAGS;
 
 struct page_table {
-    uint32_t entries[1024];
+    pte_t entries[PT_ENTRIES];
 }; typedef struct page_table page_table_t;
 
 struct page_directory {
-    uint32_t entries[1024];
+    pte_t entries[PD_ENTRIES];
 }; typedef struct page_directory page_directory_t;
 
+#define RB_RED 0
+#define RB_BLACK 1
+
+typedef enum {
+    VMA_DEMAND_PAGED = 0x1 // Backed by vmm_page_fault on first touch
+} VM_AREA_FLAGS;
+
+typedef enum {
+    PF_PRESENT  = 0x1,  // Protection violation, the page was present
+    PF_WRITE    = 0x2,
+    PF_USER     = 0x4,
+    PF_RESERVED = 0x8,  // Reserved bit set in a paging entry
+    PF_FETCH    = 0x10
+} PAGE_FAULT_ERROR;
+
+#define FAULT_AROUND_PAGES 16 // Pages mapped around a demand paging fault
+
+#define LARGE_PAGE_SIZE (1 << PDE_SHIFT) // Memory mapped by one PDE_PAGE_SIZE entry
+
+#define CR4_PSE 0x10 // 4 MiB pages
+#define CR4_PAE 0x20 // 64-bit paging entries
+#define CR4_PGE 0x80 // Global pages
+
+#define GATHER_PAGES 512        // Pages unmapped by vmm_free before the TLB is flushed and the frames freed
+#define TLB_FLUSH_THRESHOLD 32  // Flushing more pages than this flushes the whole TLB instead
+
+// Unmapped pages waiting for their TLB entries to be flushed
+struct mmu_gather {
+    uint32_t start; // Unmapped virtual range
+    uint32_t end;
+    uint32_t count;
+    phys_addr_t frames[GATHER_PAGES];
+}; typedef struct mmu_gather mmu_gather_t;
+
+// Virtual memory area, a node of a red-black tree keyed by address
 struct vm_area {
+    struct vm_area *parent;
+    struct vm_area *left;
+    struct vm_area *right;
+    struct vm_area *prev; // Neighbouring areas in address order
     struct vm_area *next;
     uint32_t addr;
     uint32_t size;
+    uint32_t max_free; // Size of the largest free area in this subtree
     uint8_t used;
+    uint8_t color;
+    uint8_t flags; // VM_AREA_FLAGS of a used area
 }; typedef struct vm_area vm_area_t;
 
+#define USER_BASE 0x400000 // Lowest user address, the first 4 MiB stay unmapped to catch NULL pointers
+
+// Address space, a page directory sharing the kernel half with all others
+struct mm {
+    page_directory_t *pd; // Kernel virtual address of the page directory
+    uint32_t cr3; // Physical address of the page directory, or of the PDPT under PAE
+#ifdef CONFIG_PAE
+    uint64_t *pdpt;
+#endif
+    vm_area_t *root; // vm areas, a red-black tree keyed by address
+    struct mm *next; // All address spaces, kept to update their kernel half
+}; typedef struct mm mm_t;
+
+#ifdef CONFIG_PAE
+#define KMAP_BASE 0xFF600000 // Temporary kernel mappings, one page per slot
+
+// The last four PDEs map the page directories onto themselves
+#define PDE_SELF 2044
+#define PAGE_TABLES 0xFF800000 // Page tables of the current address space, one page per PDE
+#define PAGE_DIRECTORY 0xFFFFC000 // Current page directories
+#else
+#define KMAP_BASE 0xFF800000 // Temporary kernel mappings, one page per slot
+
+// The last PDE maps the page directory onto itself
+#define PDE_SELF 1023
+#define PAGE_TABLES 0xFFC00000 // Page tables of the current address space, one page per PDE
+#define PAGE_DIRECTORY 0xFFFFF000 // Current page directory
+#endif
+
+typedef enum {
+    KMAP_MIGRATE,
+    KMAP_ZERO,
+    KMAP_COPY,
+    KMAP_PAGE_TABLE,
+    KMAP_SLOTS
+} KMAP_SLOT;
+
 void vmm_init(uint32_t);
-void vmm_map(uint32_t, uint32_t, uint32_t);
-uint32_t vmm_unmap(uint32_t);
-uint32_t *vmm_malloc(uint32_t);
-void vmm_free(uint32_t, uint32_t);
+void vmm_cache_init();
+void vmm_map_linear(uint32_t, uint32_t);
+void *vmm_kmap(phys_addr_t, uint32_t);
+void vmm_kunmap(uint32_t);
+uint8_t vmm_map(uint32_t, phys_addr_t, uint32_t);
+uint8_t vmm_map_range(uint32_t, phys_addr_t, const phys_addr_t *, uint32_t, uint32_t);
+phys_addr_t vmm_unmap(uint32_t);
+void vmm_unmap_range(uint32_t, uint32_t, uint8_t);
+phys_addr_t vmm_get_phys(uint32_t);
+void vmm_migrate_page(uint32_t, phys_addr_t);
+void vmm_zero_page(phys_addr_t);
+uint32_t *vmm_malloc(uint32_t, uint8_t);
+void vmm_free(uint32_t);
+uint8_t vmm_page_fault(uint32_t, uint32_t);
+void vmm_dump();
+void vmm_tree_benchmark(uint32_t);
+void vmm_map_benchmark(uint32_t);
+void vmm_linear_benchmark(uint32_t);
+mm_t *mm_create();
+mm_t *mm_clone();
+void mm_switch(mm_t *);
+void mm_destroy(mm_t *);
+uint32_t *mm_malloc(uint32_t);
+void mm_free(uint32_t);
 
 /*********************** Kernel memory, slab allocator ***********************/
 struct object {
@@ -92,25 +280,82 @@ typedef struct object object_t;
 
 struct slab {
     struct slab *next;
+    struct slab *prev;
     struct object *head;
     uint32_t in_use; // number of objects in use in in the slab
+    uint32_t base; // Address of the first object
+    uint32_t colour; // Offset of the first object from the start of the slab's memory
 };
 typedef struct slab slab_t;
 
+#define MAGAZINE_SIZE 14 // Objects held by a magazine, a magazine_t is then 64 bytes
+
+// A stack of free objects, cached in front of the slabs
+struct magazine {
+    struct magazine *next; // Depot list linkage
+    uint32_t rounds; // Number of objects held
+    void *objs[MAGAZINE_SIZE];
+};
+typedef struct magazine magazine_t;
+
+typedef enum {
+    CACHE_MAGAZINES = 0x1, // Allocations and frees go through the magazine layer
+    CACHE_GROWING   = 0x2  // cache_grow is running for the cache
+} CACHE_FLAGS;
+
 struct cache {
-    struct cache *next;
-    uint32_t obj_size;
+    struct cache *list; // List of all caches
+    const char *name;
+    uint32_t obj_size; // Object size rounded up to the alignment, the stride within a slab
     uint32_t num; // number of objects per slab
+    uint32_t pages; // Pages spanned by a slab
+    uint32_t flags; // CACHE_FLAGS
+    uint32_t link; // Offset of the free list link within a free object
+
+    // Slabs start their objects at rotating offsets within the slack of a slab
+    uint32_t colours; // Number of offsets
+    uint32_t colour_off; // Distance between offsets, a multiple of the cache line size
+    uint32_t colour_next; // Offset of the next slab, in units of colour_off
+
+    // Run once per object when a slab is built and when it is torn down
+    void (*ctor)(void *);
+    void (*dtor)(void *);
 
     slab_t *slabs_full;
     slab_t *slabs_partial;
     slab_t *slabs_empty;
+
+    // Magazines of the only CPU, loaded is used first and swapped with previous
+    magazine_t *loaded;
+    magazine_t *previous;
+
+    // Depot of magazines exchanged with the CPU
+    magazine_t *depot_full;
+    magazine_t *depot_empty;
+    uint32_t depot_count; // Full magazines in the depot
+    uint32_t depot_min; // Fewest full magazines in the depot since the last reap
+
+    uint32_t alloc_hits; // Allocations served by a magazine
+    uint32_t alloc_misses;
+    uint32_t free_hits; // Frees kept in a magazine
+    uint32_t free_misses;
+
+    uint32_t reaped; // Slabs returned by kmem_reap
 };
 typedef struct cache cache_t;
 
 void kmem_init();
+cache_t *kmem_cache_create(const char *, uint32_t, uint32_t, void (*)(void *), void (*)(void *));
+void kmem_cache_destroy(cache_t *);
+void *kmem_cache_alloc(cache_t *);
+void kmem_cache_free(cache_t *, void *);
 void *kmalloc(uint32_t);
-void kfree(void *, uint32_t);
+void kfree(void *);
+void kmem_reap();
+void kmem_dump();
+void kmem_benchmark(uint32_t);
+void kmem_colour_benchmark(uint32_t);
+void kmem_size_report();
 
 /********************************** kswapd ***********************************/
 struct lru_page {
@@ -132,6 +377,7 @@ struct lru_cache {
 typedef struct lru_cache lru_cache_t;
 
 void kswapd_init();
+void lru_cache_init();
 void lru_cache_add(uint32_t);
 void lru_cache_del(uint32_t);
 
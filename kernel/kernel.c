@@ -24,8 +24,21 @@ void kernel_main(uint32_t magic, uint32_t multiboot_info_ptr) {
 		return;
     } 
 
+	// Time memory manager setup, the linear map included
+	uint64_t start;
+	__asm__ volatile("rdtsc" : "=A"(start));
+
 	// Iinitialize physical memory manager
 	uint32_t virt_addr_start = pmm_init(mbi->mmap_addr, mbi->mmap_length);
+	if (virt_addr_start == 0) {
+		printf("Not enough memory for the physical memory manager\n");
+		return;
+	}
+
+	uint64_t end;
+	__asm__ volatile("rdtsc" : "=A"(end));
+
+	printf("pmm_init took %d cycles\n", (uint32_t)(end - start));
 
 	// Initialize virtual memory manager
 	vmm_init(virt_addr_start);
@@ -37,4 +50,13 @@ void kernel_main(uint32_t magic, uint32_t multiboot_info_ptr) {
 	//keyboard_init();
 
 	printf("Hello, kernel World!\n");
+
+	// Idle loop - background memory work runs until the next interrupt
+	for (;;) {
+		pmm_zero_idle();
+		pmm_compact_background();
+		kmem_reap();
+
+		__asm__ volatile("hlt");
+	}
 }
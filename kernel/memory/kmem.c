@@ -3,75 +3,336 @@
 #include <stdio.h>
 #include <memory.h>
 
-static object_t *object_alloc(cache_t *);
+static void slab_list_add(slab_t **, slab_t *);
+static void slab_list_remove(slab_t **, slab_t *);
+static void *object_alloc(cache_t *);
+static void object_free(cache_t *, slab_t *, void *);
+static slab_t *object_slab(void *);
+static magazine_t *magazine_create();
+static void *magazine_alloc(cache_t *);
+static uint8_t magazine_free(cache_t *, void *);
+static void set_slab_pages(uint32_t, uint32_t, slab_t *, cache_t *);
 static void slab_cache_grow(uint32_t, uint32_t);
 static void cache_grow(cache_t *);
-static cache_t *cache_create(uint32_t);
-static void cache_init(cache_t *, uint32_t);
-
-static cache_t *cache_chain = NULL;
+static void magazine_destroy(cache_t *, magazine_t *);
+static void depot_trim(cache_t *, uint32_t);
+static void cache_drain(cache_t *);
+static void slab_destroy(cache_t *, slab_t *);
+static uint32_t cache_shrink(cache_t *, uint32_t);
+static cache_t *cache_create(const char *, uint32_t, uint32_t, void (*)(void *), void (*)(void *));
+static void cache_init(cache_t *, const char *, uint32_t, uint32_t, void (*)(void *), void (*)(void *));
+static void cache_free(cache_t *, slab_t *, void *);
+
+static cache_t *cache_list = NULL;
 static cache_t *cache_cache = NULL;
 static cache_t *slab_cache = NULL;
+static cache_t *magazine_cache = NULL;
+
+// Slabs and pages returned by kmem_reap
+static uint32_t slabs_reaped = 0;
+static uint32_t pages_reaped = 0;
+
+// Empty slabs a cache keeps after kmem_reap, unless free memory is below the low watermark
+#define CACHE_EMPTY_MAX 2
+
+// Alignment of objects in caches created without one, enough for the free list link
+#define CACHE_ALIGN sizeof(object_t)
+
+#define CACHE_LINE_SIZE 64
+
+// Largest object size of a cache
+#define SLAB_MAX_SIZE (8 * PAGE_SIZE)
+
+// A slab leaves at most 1/SLAB_WASTE_FRACTION of its memory unused
+#define SLAB_WASTE_FRACTION 8
+
+// kmalloc size classes, powers of two from 32 bytes to 32 KiB and 1.5 times each in between
+#define KMALLOC_CLASSES 21
+
+static const uint32_t class_sizes[KMALLOC_CLASSES] = {
+    32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536,
+    2048, 3072, 4096, 6144, 8192, 12288, 16384, 24576, 32768
+};
+
+// Entries of size_classes for the sizes above prev up to size
+#define SIZE_INDEX(size) (((size) - 1) >> 3)
+#define SIZE_CLASS(prev, size, class) [SIZE_INDEX(prev) + 1 ... SIZE_INDEX(size)] = class
+
+// Size class of each kmalloc size, indexed by SIZE_INDEX of the size
+static const uint8_t size_classes[SIZE_INDEX(SLAB_MAX_SIZE) + 1] = {
+    [0 ... SIZE_INDEX(32)] = 0,
+    SIZE_CLASS(32, 48, 1), SIZE_CLASS(48, 64, 2), SIZE_CLASS(64, 96, 3),
+    SIZE_CLASS(96, 128, 4), SIZE_CLASS(128, 192, 5), SIZE_CLASS(192, 256, 6),
+    SIZE_CLASS(256, 384, 7), SIZE_CLASS(384, 512, 8), SIZE_CLASS(512, 768, 9),
+    SIZE_CLASS(768, 1024, 10), SIZE_CLASS(1024, 1536, 11), SIZE_CLASS(1536, 2048, 12),
+    SIZE_CLASS(2048, 3072, 13), SIZE_CLASS(3072, 4096, 14), SIZE_CLASS(4096, 6144, 15),
+    SIZE_CLASS(6144, 8192, 16), SIZE_CLASS(8192, 12288, 17), SIZE_CLASS(12288, 16384, 18),
+    SIZE_CLASS(16384, 24576, 19), SIZE_CLASS(24576, 32768, 20)
+};
+
+// General purpose caches, one per size class
+static cache_t *kmalloc_caches[KMALLOC_CLASSES];
+
+// kmalloc requests per SIZE_INDEX, the allocation mix kmem_size_report measures
+static uint32_t size_histogram[SIZE_INDEX(SLAB_MAX_SIZE) + 1];
+static uint64_t bytes_requested = 0;
+
+// Objects held at once by each pass of kmem_benchmark, more than two magazines hold
+#define BENCHMARK_BATCH 32
+
+// Slabs walked by kmem_colour_benchmark, more than the ways of a cache set
+#define COLOUR_BENCHMARK_SLABS 64
+
+// Object size of kmem_colour_benchmark, three objects leave 496 bytes of slack in a slab
+#define COLOUR_BENCHMARK_SIZE 1200
+
+/**
+ * @brief Adds a slab to the head of a slab list.
+ *
+ * @param list Pointer to the head of the list.
+ * @param slab Pointer to the slab to add.
+ */
+static void slab_list_add(slab_t **list, slab_t *slab) {
+    if (*list != NULL) (*list)->prev = slab;
+
+    slab->prev = NULL;
+    slab->next = *list;
+
+    *list = slab;
+}
+
+/**
+ * @brief Removes a slab from a slab list.
+ *
+ * The lists are doubly linked, so a slab is removed in constant time wherever
+ * it is in the list.
+ *
+ * @param list Pointer to the head of the list holding the slab.
+ * @param slab Pointer to the slab to remove.
+ */
+static void slab_list_remove(slab_t **list, slab_t *slab) {
+    if (slab->prev != NULL) slab->prev->next = slab->next;
+    else *list = slab->next;
+
+    if (slab->next != NULL) slab->next->prev = slab->prev;
+
+    slab->prev = NULL;
+    slab->next = NULL;
+}
 
 /**
  * @brief Allocates an object from a cache.
  *
- * This function retrieves a free object from @p cache by searching through
- * partially filled and empty slabs. If no slabs with free objects are available
- * the cache is grown. When an object is allocated, the slab's in-use count is
- * incremented, and the slab may be moved between different lists based on its
- * occupancy.
+ * This function retrieves a free object from @p cache, preferring partially
+ * filled slabs over empty ones so that empty slabs stay empty. If no slabs
+ * with free objects are available the cache is grown. When an object is
+ * allocated, the slab's in-use count is incremented, and the slab is moved to
+ * the full list once its free list runs out. The free list links objects
+ * through a link at the cache's link offset within each object.
  *
  * @param cache Pointer to the cache from which to allocate an object.
  * @return Pointer to the allocated object, or NULL if allocation fails.
  */
-static object_t *object_alloc(cache_t *cache) {
+static void *object_alloc(cache_t *cache) {
     if (cache->slabs_empty == NULL && cache->slabs_partial == NULL) cache_grow(cache);
-     
-    if (cache->slabs_partial != NULL) {
-        slab_t *target_slab = cache->slabs_partial;
 
-        object_t *obj = target_slab->head;
+    slab_t *slab = cache->slabs_partial != NULL ? cache->slabs_partial : cache->slabs_empty;
+
+    // The cache could not be grown
+    if (slab == NULL) return NULL;
+
+    slab_list_remove(slab->in_use == 0 ? &cache->slabs_empty : &cache->slabs_partial, slab);
+
+    object_t *link = slab->head;
+
+    slab->head = link->next;
+    slab->in_use++;
+
+    slab_list_add(slab->head == NULL ? &cache->slabs_full : &cache->slabs_partial, slab);
 
-        target_slab->head = obj->next;
-        target_slab->in_use++;
+    return (void *)((uint32_t)link - cache->link);
+}
+
+/**
+ * @brief Returns an object to its slab.
+ *
+ * The object is pushed onto the free list of @p slab and the slab's in-use
+ * count is decremented. A slab that was full moves to the partial list, a
+ * slab left with no objects in use to the empty list.
+ *
+ * @param cache Pointer to the cache that owns the slab.
+ * @param slab Pointer to the slab that owns the object.
+ * @param obj Pointer to the object to free.
+ */
+static void object_free(cache_t *cache, slab_t *slab, void *obj) {
+    // A slab with no free objects is on the full list
+    slab_list_remove(slab->head == NULL ? &cache->slabs_full : &cache->slabs_partial, slab);
+
+    object_t *link = (object_t *)((uint32_t)obj + cache->link);
+
+    link->next = slab->head;
+    slab->head = link;
+    slab->in_use--;
+
+    slab_list_add(slab->in_use == 0 ? &cache->slabs_empty : &cache->slabs_partial, slab);
+}
+
+/**
+ * @brief Finds the slab that owns an object.
+ *
+ * @param obj Pointer to an object allocated from a cache.
+ * @return Pointer to the slab recorded in the frame descriptor of the page
+ *         holding the object.
+ */
+static slab_t *object_slab(void *obj) {
+    return pmm_get_page(vmm_get_phys((uint32_t)obj))->slab;
+}
+
+/**
+ * @brief Allocates an empty magazine.
+ *
+ * Magazines come from their own cache, which does not use magazines itself.
+ *
+ * @return Pointer to the magazine, or NULL if allocation fails.
+ */
+static magazine_t *magazine_create() {
+    magazine_t *mag = object_alloc(magazine_cache);
+
+    if (mag == NULL) return NULL;
+
+    mag->next = NULL;
+    mag->rounds = 0;
+
+    return mag;
+}
+
+/**
+ * @brief Allocates an object from the magazine layer of a cache.
+ *
+ * An object is popped from the loaded magazine. When it is empty and the
+ * previous magazine is full, the two are swapped. Otherwise the empty
+ * previous magazine is returned to the depot and a full one from the depot is
+ * loaded. Only when the depot has no full magazine does the allocation miss.
+ *
+ * @param cache Pointer to the cache from which to allocate an object.
+ * @return Pointer to the object, or NULL if the caller has to allocate from
+ *         the slabs.
+ */
+static void *magazine_alloc(cache_t *cache) {
+    magazine_t *loaded = cache->loaded;
+
+    if (loaded != NULL && loaded->rounds == 0) {
+        if (cache->previous->rounds > 0) {
+            cache->loaded = cache->previous;
+            cache->previous = loaded;
+        } else if (cache->depot_full != NULL) {
+            magazine_t *full = cache->depot_full;
+            cache->depot_full = full->next;
+
+            if (--cache->depot_count < cache->depot_min) cache->depot_min = cache->depot_count;
 
-        if (target_slab->in_use == cache->num) {
-            // Set new partial slab list head
-            cache->slabs_partial = target_slab->next;
+            cache->previous->next = cache->depot_empty;
+            cache->depot_empty = cache->previous;
 
-            // Move slab to full list
-            target_slab->next = cache->slabs_full;
-            cache->slabs_full = target_slab;
+            cache->previous = loaded;
+            cache->loaded = full;
         }
 
-        return obj;
+        loaded = cache->loaded;
     }
 
-    if (cache->slabs_empty != NULL) {
-        slab_t *target_slab = cache->slabs_empty;
+    if (loaded == NULL || loaded->rounds == 0) {
+        cache->alloc_misses++;
+        return NULL;
+    }
 
-        object_t *obj = target_slab->head;
+    cache->alloc_hits++;
 
-        target_slab->head = obj->next;
-        target_slab->in_use++;
+    return loaded->objs[--loaded->rounds];
+}
 
-        // Set new empty slab list head
-        cache->slabs_empty = target_slab->next;
+/**
+ * @brief Frees an object into the magazine layer of a cache.
+ *
+ * The object is pushed onto the loaded magazine. When it is full and the
+ * previous magazine is empty, the two are swapped. Otherwise the full
+ * previous magazine goes to the depot and an empty one is loaded, taken from
+ * the depot or newly allocated. The first free of a cache allocates its
+ * loaded and previous magazines.
+ *
+ * @param cache Pointer to the cache that owns the object.
+ * @param obj Pointer to the object to free.
+ * @return 1 if the object is held by a magazine, 0 if the caller has to free
+ *         it to its slab.
+ */
+static uint8_t magazine_free(cache_t *cache, void *obj) {
+    if (cache->loaded == NULL) {
+        cache->loaded = magazine_create();
+        cache->previous = magazine_create();
+
+        if (cache->loaded == NULL || cache->previous == NULL) {
+            if (cache->loaded != NULL) kfree(cache->loaded);
+            if (cache->previous != NULL) kfree(cache->previous);
 
-        if (target_slab->in_use == cache->num) {
-            // Move slab to full list
-            target_slab->next = cache->slabs_full;
-            cache->slabs_full = target_slab;
+            cache->loaded = NULL;
+            cache->previous = NULL;
+
+            cache->free_misses++;
+            return 0;
+        }
+    }
+
+    magazine_t *loaded = cache->loaded;
+
+    if (loaded->rounds == MAGAZINE_SIZE) {
+        if (cache->previous->rounds == 0) {
+            cache->loaded = cache->previous;
+            cache->previous = loaded;
         } else {
-            // Move slab to partial list
-            target_slab->next = cache->slabs_partial;
-            cache->slabs_partial = target_slab;
+            magazine_t *empty = cache->depot_empty;
+
+            if (empty != NULL) cache->depot_empty = empty->next;
+            else empty = magazine_create();
+
+            if (empty == NULL) {
+                cache->free_misses++;
+                return 0;
+            }
+
+            cache->previous->next = cache->depot_full;
+            cache->depot_full = cache->previous;
+            cache->depot_count++;
+
+            cache->previous = loaded;
+            cache->loaded = empty;
         }
 
-        return obj;
+        loaded = cache->loaded;
+    }
+
+    cache->free_hits++;
+
+    loaded->objs[loaded->rounds++] = obj;
+
+    return 1;
+}
+
+/**
+ * @brief Records the owning slab and cache of pages in their frame descriptors.
+ *
+ * @param addr Virtual address of the first page.
+ * @param pages Number of pages.
+ * @param slab Pointer to the slab that owns the pages.
+ * @param cache Pointer to the cache that owns the pages.
+ */
+static void set_slab_pages(uint32_t addr, uint32_t pages, slab_t *slab, cache_t *cache) {
+    for (uint32_t i = 0; i < pages; i++) {
+        page_t *page = pmm_get_page(vmm_get_phys(addr + i * PAGE_SIZE));
+
+        page->flags |= PG_SLAB;
+        page->slab = slab;
+        page->cache = cache;
     }
-    return NULL; // This should never happen
 }
 
 /**
@@ -89,74 +350,224 @@ static void slab_cache_grow(uint32_t base, uint32_t length) {
     slab_t *slab = (slab_t *)(base);
     slab->head = NULL;
     slab->in_use = 0;
+    slab->colour = 0;
+
+    set_slab_pages(base, 1, slab, slab_cache);
     
     uint32_t end = base + length;
     
     base += sizeof(slab_t);
+    slab->base = base;
 
     // Create and link slab objects
-    while (base + sizeof(object_t) < end) {
+    while (base + sizeof(slab_t) <= end) {
         object_t *obj = (object_t *)base;
 
         obj->next = slab->head;
         slab->head = obj;
 
-        base += sizeof(object_t);
+        base += sizeof(slab_t);
     }
 
-    slab->next = slab_cache->slabs_empty;
-    slab_cache->slabs_empty = slab;
+    slab_list_add(&slab_cache->slabs_empty, slab);
 }
 
 /**
  * @brief Grows a cache by adding a new slab with objects.
  *
  * This function expands a cache's capacity by allocating a new slab structure
- * from the slab cache and a 4 KiB page of virtual memory to hold the objects.
- * The new page is divided into objects of the cache's object size, and all
- * objects are linked together in a free list. The new slab is added to the
- * cache's empty slabs list. If the slab cache itself needs space, it is grown
- * first.
+ * from the slab cache and the cache's number of pages of virtual memory to
+ * hold the objects.
+ * The slab structure is always kept off the slab, so large objects pack the
+ * slab exactly. The new memory is divided into objects of the cache's object
+ * size, each object is constructed if the cache has a constructor, and all
+ * objects are linked together in a free list. Objects stay constructed while
+ * they are free, so the constructor runs once per slab and not on every
+ * allocation. The objects start at the next colour offset of the cache, so the
+ * first objects of successive slabs fall into different cache sets. The new
+ * slab is added to the cache's empty slabs list. If the slab cache itself
+ * needs space, it is grown first. The frame descriptor of each page records
+ * the slab and the cache, so kfree can find both from an object's address. If
+ * memory runs out, the cache is left as it was. A cache is never grown again
+ * while it is growing, since the memory for its slab may be allocated through
+ * the cache itself.
  *
  * @param cache Pointer to the cache to grow.
  */
 static void cache_grow(cache_t *cache) {
+    if (cache->flags & CACHE_GROWING) return;
+
+    cache->flags |= CACHE_GROWING;
+
     if (slab_cache->slabs_empty == NULL && slab_cache->slabs_partial == NULL) {
-       uint32_t *addr = vmm_malloc(PAGE_SIZE);
+       uint32_t *addr = vmm_malloc(PAGE_SIZE, MIGRATE_UNMOVABLE);
+
+       if (addr == NULL) {
+           cache->flags &= ~CACHE_GROWING;
+           return;
+       }
 
        slab_cache_grow((uint32_t)addr, PAGE_SIZE);
     }
 
-    object_t *slab_obj = object_alloc(slab_cache);
-
-    slab_t *new_slab = (slab_t *)slab_obj;
+    slab_t *new_slab = object_alloc(slab_cache);
     new_slab->head = NULL;
     new_slab->in_use = 0;
-    new_slab->next = NULL;
 
-    uint32_t *addr = vmm_malloc(PAGE_SIZE);
+    uint32_t addr = (uint32_t)vmm_malloc(cache->pages * PAGE_SIZE, MIGRATE_RECLAIMABLE);
 
-    // Create and link 4 KiB of objects for the slab
-    uint32_t end = (uint32_t)addr + PAGE_SIZE;
+    if (addr == 0) {
+        kfree(new_slab);
+        cache->flags &= ~CACHE_GROWING;
+        return;
+    }
 
-    while ((uint32_t)addr + cache->obj_size < end) {
-        object_t *obj = (object_t *)addr;
+    set_slab_pages(addr, cache->pages, new_slab, cache);
+
+    uint32_t end = addr + cache->pages * PAGE_SIZE;
+
+    new_slab->colour = cache->colour_next * cache->colour_off;
+    new_slab->base = addr + new_slab->colour;
+
+    if (++cache->colour_next == cache->colours) cache->colour_next = 0;
+
+    // Create, construct and link the objects of the slab
+    addr = new_slab->base;
+
+    while (addr + cache->obj_size <= end) {
+        if (cache->ctor != NULL) cache->ctor((void *)addr);
+
+        object_t *link = (object_t *)(addr + cache->link);
+
+        link->next = new_slab->head;
+        new_slab->head = link;
+
+        addr += cache->obj_size;
+    }
+
+    slab_list_add(&cache->slabs_empty, new_slab);
+
+    cache->flags &= ~CACHE_GROWING;
+}
+
+/**
+ * @brief Frees a magazine and returns the objects it holds to their slabs.
+ *
+ * @param cache Pointer to the cache that owns the objects.
+ * @param mag Pointer to the magazine.
+ */
+static void magazine_destroy(cache_t *cache, magazine_t *mag) {
+    while (mag->rounds > 0) {
+        void *obj = mag->objs[--mag->rounds];
+
+        object_free(cache, object_slab(obj), obj);
+    }
+
+    object_free(magazine_cache, object_slab(mag), mag);
+}
+
+/**
+ * @brief Frees magazines in the depot of a cache.
+ *
+ * Up to @p full full magazines are freed and their objects go back to their
+ * slabs, so the slabs can become empty. All empty magazines are freed. The
+ * loaded and previous magazines are kept.
+ *
+ * @param cache Pointer to the cache.
+ * @param full Number of full magazines to free.
+ */
+static void depot_trim(cache_t *cache, uint32_t full) {
+    for (; full > 0 && cache->depot_full != NULL; full--) {
+        magazine_t *mag = cache->depot_full;
+        cache->depot_full = mag->next;
+        cache->depot_count--;
+
+        magazine_destroy(cache, mag);
+    }
+
+    cache->depot_min = cache->depot_count;
+
+    while (cache->depot_empty != NULL) {
+        magazine_t *mag = cache->depot_empty;
+        cache->depot_empty = mag->next;
+
+        magazine_destroy(cache, mag);
+    }
+}
+
+/**
+ * @brief Returns the objects held by the magazines of a cache to their slabs.
+ *
+ * The depot is drained, then the loaded and previous magazines are freed.
+ *
+ * @param cache Pointer to the cache to drain.
+ */
+static void cache_drain(cache_t *cache) {
+    depot_trim(cache, cache->depot_count);
+
+    if (cache->loaded == NULL) return;
+
+    magazine_destroy(cache, cache->loaded);
+    magazine_destroy(cache, cache->previous);
+
+    cache->loaded = NULL;
+    cache->previous = NULL;
+}
 
-        obj->next = new_slab->head;
-        new_slab->head = obj;
+/**
+ * @brief Tears down an empty slab and returns its memory.
+ *
+ * Each object is destructed if the cache has a destructor, then the pages of
+ * the slab are freed and the slab structure returned to the slab cache.
+ *
+ * @param cache Pointer to the cache that owns the slab.
+ * @param slab Pointer to the slab, which must have no objects in use.
+ */
+static void slab_destroy(cache_t *cache, slab_t *slab) {
+    slab_list_remove(&cache->slabs_empty, slab);
 
-        addr = (uint32_t *)((uint32_t)addr + cache->obj_size);
+    if (cache->dtor != NULL) {
+        for (uint32_t i = 0; i < cache->num; i++) cache->dtor((void *)(slab->base + i * cache->obj_size));
     }
 
-    new_slab->next = cache->slabs_empty;
-    cache->slabs_empty = new_slab;
+    uint32_t addr = slab->base - slab->colour;
+
+    for (uint32_t i = 0; i < cache->pages; i++) {
+        pmm_get_page(vmm_get_phys(addr + i * PAGE_SIZE))->flags &= ~PG_SLAB;
+    }
+
+    vmm_free(addr);
+
+    cache_free(slab_cache, object_slab(slab), slab);
 }
 
-/* TODO: cache shrinking
-static void cache_shrink() {
+/**
+ * @brief Destroys the empty slabs of a cache beyond a number to keep.
+ *
+ * The next slab is read before a slab is destroyed: freeing its memory may
+ * free vm area nodes, which only adds slabs to the head of a list.
+ *
+ * @param cache Pointer to the cache to shrink.
+ * @param keep Number of empty slabs to keep.
+ * @return The number of slabs destroyed.
+ */
+static uint32_t cache_shrink(cache_t *cache, uint32_t keep) {
+    uint32_t destroyed = 0;
+
+    for (slab_t *slab = cache->slabs_empty; slab != NULL;) {
+        slab_t *next = slab->next;
 
+        if (keep > 0) keep--;
+        else {
+            slab_destroy(cache, slab);
+            destroyed++;
+        }
+
+        slab = next;
+    }
+
+    return destroyed;
 }
-*/
 
 /**
  * @brief Creates a new cache for objects of a specific size.
@@ -164,21 +575,28 @@ static void cache_shrink() {
  * This function allocates a new cache structure from the cache of caches,
  * initializes it for the specified object size, and grows it to contain an
  * initial slab of objects. If the cache of caches has no free cache structures
- * available, it is grown first.
+ * available, it is grown first. The cache is added to the list of all caches.
  *
- * @param obj_size The size of objects that will be stored in this cache.
- * @return Pointer to the newly created cache.
+ * @param name Name of the cache, shown by kmem_dump.
+ * @param size The size of objects that will be stored in this cache.
+ * @param align Alignment of the objects, a power of two, or 0 for CACHE_ALIGN.
+ * @param ctor Constructor run on each object when a slab is built, or NULL.
+ * @param dtor Destructor run on each object when a slab is destroyed, or NULL.
+ * @return Pointer to the newly created cache, or NULL if allocation fails.
  */
-static cache_t *cache_create(uint32_t obj_size) {
+static cache_t *cache_create(const char *name, uint32_t size, uint32_t align, void (*ctor)(void *), void (*dtor)(void *)) {
     if (cache_cache->slabs_empty == NULL && cache_cache->slabs_partial == NULL) cache_grow(cache_cache);
 
-    object_t *cache_obj = object_alloc(cache_cache);
+    cache_t *new_cache = object_alloc(cache_cache);
 
-    cache_t *new_cache = (cache_t *)cache_obj;
+    if (new_cache == NULL) return NULL;
 
-    cache_init(new_cache, obj_size);
+    cache_init(new_cache, name, size, align, ctor, dtor);
     cache_grow(new_cache);
 
+    new_cache->list = cache_list;
+    cache_list = new_cache;
+
     return new_cache;
 }
 
@@ -186,20 +604,71 @@ static cache_t *cache_create(uint32_t obj_size) {
  * @brief Initializes a cache structure with specified parameters.
  *
  * This function sets up a cache_t structure by configuring its object size,
- * calculating the number of objects that fit in a 4 KiB slab, and initializing
- * all slab list pointers to NULL. The cache is prepared for use but contains no
- * slabs until it is grown.
+ * choosing the slab size, calculating the number of objects that fit in a
+ * slab, and initializing all slab list pointers to NULL. The object size is
+ * @p size rounded up to the alignment, so objects are packed exactly. A slab
+ * spans the fewest pages that waste at most 1/SLAB_WASTE_FRACTION of it.
+ * Less than one object is wasted, so a slab of SLAB_WASTE_FRACTION objects
+ * always meets the bound and a slab spans at most 64 pages. Objects of a
+ * cache with a constructor or destructor keep their constructed state while
+ * free, so their free list link is placed behind the object rather than over
+ * its first word. The slack left in a slab after its objects gives the number
+ * of colours, the offsets at which slabs start their objects, in steps of a
+ * cache line or of the alignment if it is larger. The cache is prepared for
+ * use but contains no slabs until it is grown.
  *
  * @param cache Pointer to the cache structure to initialize.
- * @param obj_size The size of objects that will be stored in this cache.
+ * @param name Name of the cache.
+ * @param size The size of objects that will be stored in this cache.
+ * @param align Alignment of the objects, a power of two, or 0 for CACHE_ALIGN.
+ * @param ctor Constructor run on each object when a slab is built, or NULL.
+ * @param dtor Destructor run on each object when a slab is destroyed, or NULL.
  */
-static void cache_init(cache_t *cache, uint32_t obj_size) {
-    cache->obj_size = obj_size;
-    cache->num = PAGE_SIZE / obj_size;
-    cache->next = NULL;
+static void cache_init(cache_t *cache, const char *name, uint32_t size, uint32_t align, void (*ctor)(void *), void (*dtor)(void *)) {
+    if (align < CACHE_ALIGN) align = CACHE_ALIGN;
+
+    if (ctor != NULL || dtor != NULL) {
+        cache->link = (size + CACHE_ALIGN - 1) & ~(CACHE_ALIGN - 1);
+        size = cache->link + sizeof(object_t);
+    } else {
+        cache->link = 0;
+        if (size < sizeof(object_t)) size = sizeof(object_t);
+    }
+
+    cache->name = name;
+    cache->obj_size = (size + align - 1) & ~(align - 1);
+
+    uint32_t slab_size = PAGE_SIZE;
+
+    for (cache->pages = 1; slab_size < cache->obj_size || slab_size % cache->obj_size > slab_size / SLAB_WASTE_FRACTION; cache->pages++) {
+        slab_size += PAGE_SIZE;
+    }
+
+    cache->num = slab_size / cache->obj_size;
+    cache->colour_off = align > CACHE_LINE_SIZE ? align : CACHE_LINE_SIZE;
+    cache->colours = (slab_size - cache->num * cache->obj_size) / cache->colour_off + 1;
+    cache->colour_next = 0;
+    cache->flags = 0;
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    cache->list = NULL;
     cache->slabs_full = NULL;
     cache->slabs_partial = NULL;
     cache->slabs_empty = NULL;
+
+    cache->loaded = NULL;
+    cache->previous = NULL;
+    cache->depot_full = NULL;
+    cache->depot_empty = NULL;
+    cache->depot_count = 0;
+    cache->depot_min = 0;
+
+    cache->alloc_hits = 0;
+    cache->alloc_misses = 0;
+    cache->free_hits = 0;
+    cache->free_misses = 0;
+
+    cache->reaped = 0;
 }
 
 /**
@@ -207,130 +676,413 @@ static void cache_init(cache_t *cache, uint32_t obj_size) {
  *
  * This function sets up the kernel heap manager. It initializes two special
  * caches, one for slab structures and one for cache structures, using a single
- * 4 KiB page from the virtual memory manager. It then creates a chain of
- * general-purpose caches for object sizes from 32 bytes to 2048 bytes.
+ * 4 KiB page from the virtual memory manager. It then creates the cache of
+ * magazines and the general-purpose caches of the kmalloc size classes from 32
+ * bytes to 32 KiB, which allocate through the magazine layer.
  */
 void kmem_init() {
     // Initialize slab cache
-    uint32_t slab_page = (uint32_t)vmm_malloc(PAGE_SIZE);
+    uint32_t slab_page = (uint32_t)vmm_malloc(PAGE_SIZE, MIGRATE_UNMOVABLE);
 
     slab_cache = (cache_t *)slab_page;
-    cache_init(slab_cache, sizeof(slab_t));
+    cache_init(slab_cache, "slab_t", sizeof(slab_t), 0, NULL, NULL);
     slab_cache_grow(slab_page + sizeof(cache_t), PAGE_SIZE - sizeof(cache_t));
 
     // Initialize cache cache
-    uint32_t cache_page = (uint32_t)vmm_malloc(PAGE_SIZE);
+    uint32_t cache_page = (uint32_t)vmm_malloc(PAGE_SIZE, MIGRATE_UNMOVABLE);
 
     cache_cache = (cache_t *)cache_page;
-    cache_init(cache_cache, sizeof(cache_t));
+    cache_init(cache_cache, "cache_t", sizeof(cache_t), 0, NULL, NULL);
 
     // Grow cache_cache with the rest of this page
     uint32_t addr = cache_page + sizeof(cache_t);
 
-    slab_t *cache_slab = (slab_t *)object_alloc(slab_cache);
+    slab_t *cache_slab = object_alloc(slab_cache);
     cache_slab->head = NULL;
     cache_slab->in_use = 0;
-    cache_slab->next = NULL;
+    cache_slab->base = addr;
+    cache_slab->colour = 0;
+
+    set_slab_pages(cache_page, 1, cache_slab, cache_cache);
 
     uint32_t end = cache_page + PAGE_SIZE;
 
-    while (addr + sizeof(cache_t) < end) {
+    while (addr + sizeof(cache_t) <= end) {
         object_t *obj = (object_t *)addr;
         obj->next = cache_slab->head;
         cache_slab->head = obj;
         addr += sizeof(cache_t);
     }
 
-    cache_cache->slabs_empty = cache_slab;
+    slab_list_add(&cache_cache->slabs_empty, cache_slab);
+
+    cache_cache->list = slab_cache;
+    cache_list = cache_cache;
+
+    magazine_cache = cache_create("magazine_t", sizeof(magazine_t), 0, NULL, NULL);
+
+    // Create general purpose caches, smallest first so vm area nodes can be allocated
+    for (int i = 0; i < KMALLOC_CLASSES; i++) {
+        kmalloc_caches[i] = cache_create("kmalloc", class_sizes[i], 0, NULL, NULL);
+        kmalloc_caches[i]->flags |= CACHE_MAGAZINES;
+    }
+
+    // Descriptors of the virtual memory manager and kswapd get caches of their own
+    vmm_cache_init();
+    lru_cache_init();
+}
+
+/**
+ * @brief Creates a cache of objects of one type.
+ *
+ * Objects are packed in slabs at their exact size rounded up to @p align,
+ * rather than in the next power of two kmalloc would use. @p ctor runs on
+ * every object when a slab is built and @p dtor when it is destroyed, freed
+ * objects are expected to be returned in their constructed state. Allocations
+ * and frees go through the magazine layer.
+ *
+ * @param name Name of the cache, shown by kmem_dump.
+ * @param size The size of the objects, at most SLAB_MAX_SIZE.
+ * @param align Alignment of the objects, a power of two up to 4 KiB, or 0 for
+ *              word alignment.
+ * @param ctor Constructor run on each object when a slab is built, or NULL.
+ * @param dtor Destructor run on each object when a slab is destroyed, or NULL.
+ * @return Pointer to the new cache, or NULL if the parameters are invalid or
+ *         allocation fails.
+ */
+cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align, void (*ctor)(void *), void (*dtor)(void *)) {
+    if (size == 0 || size > SLAB_MAX_SIZE || align > PAGE_SIZE || (align & (align - 1))) return NULL;
+
+    // The free list link placed behind a constructed object has to fit as well
+    if ((ctor != NULL || dtor != NULL) && size > SLAB_MAX_SIZE - sizeof(object_t)) return NULL;
+
+    cache_t *cache = cache_create(name, size, align, ctor, dtor);
 
-    // Create general purpose caches for sizes 2^5 to 2^11
-    for (int i = 11; i >= 5; i--) {
-        cache_t *cache = cache_create(1 << i);
+    if (cache != NULL) cache->flags |= CACHE_MAGAZINES;
+
+    return cache;
+}
+
+/**
+ * @brief Destroys a cache created by kmem_cache_create.
+ *
+ * The magazine layer is drained and every slab is destroyed, running the
+ * destructor on its objects. A cache that still has objects in use is left as
+ * it is.
+ *
+ * @param cache Pointer to the cache to destroy.
+ */
+void kmem_cache_destroy(cache_t *cache) {
+    cache_drain(cache);
 
-        cache->next = cache_chain;
-        cache_chain = cache;
+    if (cache->slabs_full != NULL || cache->slabs_partial != NULL) {
+        printf("kmem_cache_destroy: %s still has objects in use\n", cache->name);
+        return;
     }
+
+    while (cache->slabs_empty != NULL) slab_destroy(cache, cache->slabs_empty);
+
+    cache_t **prev = &cache_list;
+
+    while (*prev != cache) prev = &(*prev)->list;
+
+    *prev = cache->list;
+
+    cache_free(cache_cache, object_slab(cache), cache);
+}
+
+/**
+ * @brief Allocates an object from a cache.
+ *
+ * The object is taken from the magazine layer if the cache has one, and only
+ * otherwise from the slabs. It is in its constructed state.
+ *
+ * @param cache Pointer to the cache to allocate from.
+ * @return Pointer to the object, or NULL if allocation fails.
+ */
+void *kmem_cache_alloc(cache_t *cache) {
+    void *obj = cache->flags & CACHE_MAGAZINES ? magazine_alloc(cache) : NULL;
+
+    return obj != NULL ? obj : object_alloc(cache);
+}
+
+/**
+ * @brief Frees an object to the cache it was allocated from.
+ *
+ * @param cache Pointer to the cache that owns the object.
+ * @param obj Pointer to the object, in its constructed state.
+ */
+void kmem_cache_free(cache_t *cache, void *obj) {
+    cache_free(cache, object_slab(obj), obj);
+}
+
+/**
+ * @brief Frees an object to the magazine layer of its cache or to its slab.
+ *
+ * @param cache Pointer to the cache that owns the object.
+ * @param slab Pointer to the slab that owns the object.
+ * @param obj Pointer to the object to free.
+ */
+static void cache_free(cache_t *cache, slab_t *slab, void *obj) {
+    if (cache->flags & CACHE_MAGAZINES && magazine_free(cache, obj)) return;
+
+    object_free(cache, slab, obj);
 }
 
 /**
  * @brief Allocates kernel memory of the requested size.
  *
  * This function provides dynamic memory allocation for the kernel. For
- * allocations larger than 2048 bytes, memory is allocated directly from the
- * virtual memory manager. For smaller allocations, the function searches the
- * cache chain to find the smallest cache that can accommodate the requested
- * size, then allocates an object from that cache.
+ * allocations larger than SLAB_MAX_SIZE, memory is allocated directly from
+ * the virtual memory manager. For smaller allocations, the size class is read
+ * from the size_classes table at SIZE_INDEX of the size, without searching,
+ * and an object is allocated from the cache of that class. The object is taken
+ * from the magazine layer, and only otherwise from the slabs. The request is
+ * recorded in the size histogram.
  *
  * @param length The size of memory to allocate (in bytes).
  * @return Pointer to the allocated memory, or NULL if allocation fails.
  */
 void *kmalloc(uint32_t length) {
-    if (length > PAGE_SIZE / 2) return vmm_malloc(length);
-
-    cache_t *curr = cache_chain;
+    if (length > SLAB_MAX_SIZE) return vmm_malloc(length, MIGRATE_MOVABLE);
 
-    while (curr != NULL) {
-        if (curr->obj_size >= length) return object_alloc(curr);
+    // A zero length gets the smallest class
+    uint32_t index = length > 0 ? SIZE_INDEX(length) : 0;
 
-        curr = curr->next;
-    }
+    size_histogram[index]++;
+    bytes_requested += length;
 
-    return NULL;
+    return kmem_cache_alloc(kmalloc_caches[size_classes[index]]);
 }
 
 /**
  * @brief Frees previously allocated kernel memory.
  *
- * This function returns memory to the kernel memory manager. For allocations
- * larger than 2048 bytes, memory is freed directly through the virtual memory
- * manager. For smaller allocations, the function finds the appropriate cache in
- * the cache chain and returns the object to its slab. When an object is freed,
- * the slab's in-use count is decremented, and the slab may be moved between
- * lists based on its new occupancy state.
+ * This function returns memory to the kernel memory manager. The frame
+ * descriptor of the page holding @p obj tells whether it came from a slab.
+ * Memory that did not, or that was never touched and so has no page yet, is
+ * freed directly through the virtual memory manager.
+ * Otherwise the object is kept in the magazine layer of the cache recorded in
+ * the frame descriptor, or returned to the slab recorded there, so no size is
+ * needed and no list is searched.
  *
  * @param obj Pointer to the memory to free.
- * @param length The size of the memory allocation (in bytes).
  */
-void kfree(void *obj, uint32_t length) {
+void kfree(void *obj) {
     uint32_t addr = (uint32_t)obj;
+
+    phys_addr_t phys_addr = vmm_get_phys(addr);
+    page_t *page = pmm_get_page(phys_addr);
     
-    if (length > PAGE_SIZE / 2) {
-        vmm_free(addr, length);
+    if (phys_addr == 0 || !(page->flags & PG_SLAB)) {
+        vmm_free(addr);
         return;
     }
 
-    cache_t *curr = cache_chain;
+    cache_free(page->cache, page->slab, obj);
+}
+
+/**
+ * @brief Returns surplus memory of all caches to the physical memory manager.
+ *
+ * Full magazines that stayed in the depot of a cache since the last reap are
+ * outside its working set. They are freed and their objects returned to their
+ * slabs. Each cache then keeps up to CACHE_EMPTY_MAX empty slabs and the
+ * others are destroyed. While free memory is below the low watermark, all
+ * magazines are freed, as those of large object caches pin many pages, and no
+ * empty slab is kept. Caches drained first free their magazines to the cache
+ * of magazines, which comes later in the list and is shrunk after them.
+ * The slabs of the slab and cache descriptor caches are set up by kmem_init
+ * and are never reaped.
+ */
+void kmem_reap() {
+    uint8_t pressure = pmm.free / PAGE_SIZE < pmm_low_watermark();
+
+    for (cache_t *cache = cache_list; cache != NULL; cache = cache->list) {
+        if (cache == slab_cache || cache == cache_cache) continue;
+
+        if (pressure) cache_drain(cache);
+        else depot_trim(cache, cache->depot_min);
+
+        uint32_t destroyed = cache_shrink(cache, pressure ? 0 : CACHE_EMPTY_MAX);
+
+        cache->reaped += destroyed;
+        slabs_reaped += destroyed;
+        pages_reaped += destroyed * cache->pages;
+    }
+}
+
+/**
+ * @brief Prints the object size and magazine layer statistics of all caches.
+ */
+void kmem_dump() {
+    for (cache_t *cache = cache_list; cache != NULL; cache = cache->list) {
+        uint32_t empty = 0;
 
-    while (curr->next != NULL) {
-        if (curr->obj_size >= length) break;
+        for (magazine_t *mag = cache->depot_empty; mag != NULL; mag = mag->next) empty++;
 
-        curr = curr->next;
+        printf("Cache %s %d, %d pages: alloc hits %d/%d, free hits %d/%d, depot %d full %d empty, %d slabs reaped\n",
+               cache->name, cache->obj_size, cache->pages, cache->alloc_hits, cache->alloc_hits + cache->alloc_misses,
+               cache->free_hits, cache->free_hits + cache->free_misses, cache->depot_count, empty, cache->reaped);
     }
 
-    // Return the object to its slab in the corresponding cache
-    if (curr->slabs_full != NULL) {
-        slab_t *target_slab = curr->slabs_full;
+    printf("Reaped %d slabs, %d pages\n", slabs_reaped, pages_reaped);
+}
 
-        object_t *head = target_slab->head;
+/**
+ * @brief Measures small object allocation with and without magazines.
+ *
+ * For each general purpose cache up to 256 bytes, @p pairs allocations and
+ * frees are made in batches of BENCHMARK_BATCH objects, first through the
+ * magazine layer and then straight from the slabs. The cycles per pair are
+ * read from the time stamp counter and printed together with the magazine hit
+ * rates of the first run.
+ *
+ * @param pairs The number of allocation and free pairs per run.
+ */
+void kmem_benchmark(uint32_t pairs) {
+    void *objs[BENCHMARK_BATCH];
 
-        head->next = target_slab->head;
-        target_slab->head = head;
-        target_slab->in_use--;
+    if (pairs == 0) return;
 
-        curr->slabs_full = NULL;
-        curr->slabs_partial = target_slab;
-    } else if (curr->slabs_partial != NULL) {
-        slab_t *target_slab = curr->slabs_partial;
+    for (int i = 0; i < KMALLOC_CLASSES && class_sizes[i] <= 256; i++) {
+        cache_t *cache = kmalloc_caches[i];
+        uint32_t flags = cache->flags;
+        uint32_t cycles[2];
 
-        object_t *head = target_slab->head;
+        cache->alloc_hits = cache->alloc_misses = cache->free_hits = cache->free_misses = 0;
 
-        head->next = target_slab->head;
-        target_slab->head = head;
-        target_slab->in_use--;
+        for (int run = 0; run < 2; run++) {
+            if (run == 1) cache->flags &= ~CACHE_MAGAZINES;
 
-        if (target_slab->in_use == 0) {
-            curr->slabs_partial = NULL;
-            curr->slabs_empty = target_slab;
+            uint64_t start;
+            __asm__ volatile("rdtsc" : "=A"(start));
+
+            for (uint32_t i = 0; i < pairs; i += BENCHMARK_BATCH) {
+                for (int j = 0; j < BENCHMARK_BATCH; j++) objs[j] = kmalloc(cache->obj_size);
+                for (int j = 0; j < BENCHMARK_BATCH; j++) kfree(objs[j]);
+            }
+
+            uint64_t end;
+            __asm__ volatile("rdtsc" : "=A"(end));
+
+            cycles[run] = (uint32_t)(end - start) / pairs;
         }
+
+        cache->flags = flags;
+
+        printf("%d bytes: %d cycles per pair with magazines (alloc hits %d/%d, free hits %d/%d), %d without\n",
+               cache->obj_size, cycles[0], cache->alloc_hits, cache->alloc_hits + cache->alloc_misses,
+               cache->free_hits, cache->free_hits + cache->free_misses, cycles[1]);
     }
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Measures walking objects of many slabs with and without colouring.
+ *
+ * A cache of COLOUR_BENCHMARK_SIZE byte objects is filled with
+ * COLOUR_BENCHMARK_SLABS slabs, first with colouring disabled and then with
+ * it enabled. The first word of the first object of every slab is read
+ * @p passes times. Without colouring these words all share one cache set and
+ * evict each other, with colouring they spread over as many sets as the cache
+ * has colours. The cycles per read are read from the time stamp counter.
+ *
+ * @param passes The number of walks over the slabs per run.
+ */
+void kmem_colour_benchmark(uint32_t passes) {
+    void *firsts[COLOUR_BENCHMARK_SLABS];
+    uint32_t cycles[2];
+    uint32_t colours = 0;
+
+    if (passes == 0) return;
+
+    for (int run = 0; run < 2; run++) {
+        cache_t *cache = kmem_cache_create("colour_benchmark", COLOUR_BENCHMARK_SIZE, 0, NULL, NULL);
+
+        if (cache == NULL) return;
+
+        colours = cache->colours;
+
+        // Disabled colouring starts every later slab at offset 0 too
+        if (run == 0) {
+            cache->colours = 1;
+            cache->colour_next = 0;
+        }
+
+        uint32_t count = COLOUR_BENCHMARK_SLABS * cache->num;
+        void **objs = kmalloc(count * sizeof(void *));
+
+        if (objs == NULL) {
+            kmem_cache_destroy(cache);
+            return;
+        }
+
+        uint32_t slabs = 0;
+
+        for (uint32_t i = 0; i < count; i++) {
+            objs[i] = kmem_cache_alloc(cache);
+
+            if (objs[i] != NULL && object_slab(objs[i])->base == (uint32_t)objs[i]) firsts[slabs++] = objs[i];
+        }
+
+        uint64_t start;
+        __asm__ volatile("rdtsc" : "=A"(start));
+
+        for (uint32_t pass = 0; pass < passes; pass++) {
+            for (uint32_t i = 0; i < slabs; i++) (void)*(volatile uint32_t *)firsts[i];
+        }
+
+        uint64_t end;
+        __asm__ volatile("rdtsc" : "=A"(end));
+
+        cycles[run] = slabs > 0 ? (uint32_t)(end - start) / (passes * slabs) : 0;
+
+        for (uint32_t i = 0; i < count; i++) {
+            if (objs[i] != NULL) kmem_cache_free(cache, objs[i]);
+        }
+
+        kfree(objs);
+        kmem_cache_destroy(cache);
+    }
+
+    printf("%d slabs of %d byte objects: %d cycles per read uncoloured, %d with %d colours\n",
+           COLOUR_BENCHMARK_SLABS, COLOUR_BENCHMARK_SIZE, cycles[0], cycles[1], colours);
+}
+
+/**
+ * @brief Measures internal fragmentation of the recorded kmalloc requests.
+ *
+ * Every size class boundary is a multiple of 8 bytes, so all sizes of one
+ * histogram entry share a class, both with the current classes and with
+ * powers of two only. Each request is charged the memory its object really
+ * takes, the slab size divided by the objects per slab, rounded down to a
+ * byte. The memory the recorded requests took is compared with the memory
+ * they would have taken with power of two classes from 32 bytes, which are
+ * the even classes.
+ */
+void kmem_size_report() {
+    uint64_t allocated = 0;
+    uint64_t pow2 = 0;
+
+    for (uint32_t i = 0; i <= SIZE_INDEX(SLAB_MAX_SIZE); i++) {
+        if (size_histogram[i] == 0) continue;
+
+        cache_t *cache = kmalloc_caches[size_classes[i]];
+
+        // The power of two class is the current class, or the next one when it is in between
+        cache_t *pow2_cache = kmalloc_caches[(size_classes[i] + 1) & ~1];
+
+        allocated += (uint64_t)size_histogram[i] * (cache->pages * PAGE_SIZE / cache->num);
+        pow2 += (uint64_t)size_histogram[i] * (pow2_cache->pages * PAGE_SIZE / pow2_cache->num);
+    }
+
+    uint32_t requested_kib = bytes_requested >> 10;
+    uint32_t allocated_kib = allocated >> 10;
+    uint32_t pow2_kib = pow2 >> 10;
+
+    if (allocated_kib == 0) return;
+
+    printf("kmalloc: %d KiB requested, %d KiB allocated (%d%% waste), %d KiB with powers of two (%d%% waste)\n",
+           requested_kib, allocated_kib, (allocated_kib - requested_kib) * 100 / allocated_kib,
+           pow2_kib, (pow2_kib - requested_kib) * 100 / pow2_kib);
+}
@@ -7,10 +7,14 @@ static void list_append(lru_page_t **, lru_page_t *);
 static void list_remove(lru_page_t **, lru_page_t *);
 static void refill(uint32_t);
 static void reclaim(uint32_t);
-static void balance(uint32_t);
+static void balance(uint32_t) __attribute__((unused)); // Called by the kswapd thread loop, not written yet
+static void set_active(lru_page_t *, uint8_t);
 
 lru_cache_t lru_cache __attribute__((section(".LRU_cache")));
 
+// Cache of LRU page descriptors
+static cache_t *lru_page_cache = NULL;
+
 /**
  * @brief Appends a node at the head of a LRU list.
  *
@@ -46,6 +50,19 @@ static void list_remove(lru_page_t **list_tail, lru_page_t *node) {
     if (node->next != NULL) node->next->prev = node->prev;
 }
 
+/**
+ * @brief Records which LRU list a page is on in its frame descriptor.
+ *
+ * @param node The LRU node of the page.
+ * @param active 1 if the page is on the active list, 0 otherwise.
+ */
+static void set_active(lru_page_t *node, uint8_t active) {
+    page_t *page = pmm_get_page(vmm_get_phys(node->virt_addr & PTE_FRAME));
+
+    if (active) page->flags |= PG_ACTIVE;
+    else page->flags &= ~PG_ACTIVE;
+}
+
 /**
  * @brief Refills the inactive list by scanning and demoting active pages.
  *
@@ -74,6 +91,7 @@ static void refill(uint32_t target) {
         if ((curr->virt_addr & 0x20) == 0) {
             // Demote to inactive list
             list_append(&lru_cache.inactive_head, curr);
+            set_active(curr, 0);
 
             /*
             TODO: clear present bit
@@ -97,7 +115,7 @@ static void refill(uint32_t target) {
  * @brief Reclaims or promotes pages from the inactive list.
  *
  * This function scans the inactive list from its tail while the current
- * reclaim @p mark is below the global @c high_watermark. For each page:
+ * reclaim @p mark is below the high watermark. For each page:
  *  - if the accessed bit is set, the page is promoted back to the active list;
  *  - if the accessed bit is clear, the page is considered reclaimable and
  *    @p mark is incremented (actual swap-out is still a TODO).
@@ -107,7 +125,7 @@ static void refill(uint32_t target) {
 static void reclaim(uint32_t mark) {
     lru_page_t *curr = lru_cache.inactive_tail;
 
-    while (mark < high_watermark) {
+    while (mark < pmm_high_watermark()) {
         // Remove from inactive list - it will either be promoted or reclaimed
         list_remove(&lru_cache.inactive_tail, curr);
 
@@ -118,6 +136,7 @@ static void reclaim(uint32_t mark) {
 
             // Promote to active list
             list_append(&lru_cache.active_head, curr);
+            set_active(curr, 1);
 
             lru_cache.active++;
         }
@@ -187,64 +206,76 @@ void kswapd_init() {
     call balance
 
     sleep when high_watermark has been reached
+    call pmm_compact_background while idle
     */
 }
 
+/**
+ * @brief Creates the cache of LRU page descriptors.
+ *
+ * Called by kmem_init once the slab allocator is initialized.
+ */
+void lru_cache_init() {
+    lru_page_cache = kmem_cache_create("lru_page_t", sizeof(lru_page_t), 0, NULL, NULL);
+}
+
 /**
  * @brief Adds a page to the LRU cache.
  *
  * This function allocates a new LRU page descriptor and inserts it into the
- * inactive list, incrementing the inactive page count.
+ * inactive list, incrementing the inactive page count. The descriptor is
+ * recorded in the frame descriptor of the page.
  *
  * @param virt_addr Virtual address (or page table entry value) of the page.
  */
 void lru_cache_add(uint32_t virt_addr) {
-    lru_page_t *node = kmalloc(sizeof(lru_page_t));
+    lru_page_t *node = kmem_cache_alloc(lru_page_cache);
 
     node->virt_addr = virt_addr;
 
     list_append(&lru_cache.inactive_head, node);
 
     lru_cache.inactive++;
+
+    page_t *page = pmm_get_page(vmm_get_phys(virt_addr & PTE_FRAME));
+
+    page->flags = (page->flags | PG_LRU) & ~PG_ACTIVE;
+    page->lru = node;
 }
 
 /**
  * @brief Removes a page from the LRU cache.
  *
- * This function searches both the active and inactive lists for a page whose
- * recorded virtual address matches @p virt_addr. When found, the page is
- * unlinked from its list.
+ * This function finds the LRU node of the page mapped at @p virt_addr through
+ * its frame descriptor and unlinks it from the list the descriptor says it is
+ * on.
  *
  * @param virt_addr Virtual address of the page to remove from the cache.
  */
 void lru_cache_del(uint32_t virt_addr) {
-    lru_page_t *active_curr = lru_cache.active_head;
+    page_t *page = pmm_get_page(vmm_get_phys(virt_addr & PTE_FRAME));
 
-    while (active_curr != NULL) {
-        if (active_curr->virt_addr == virt_addr) {
-            list_remove(&lru_cache.active_tail, active_curr);
+    if (!(page->flags & PG_LRU)) return;
 
-            // Free lru cache node
-            kfree(active_curr, sizeof(lru_page_t));
+    lru_page_t *node = page->lru;
 
-            return;
-        }
+    if (page->flags & PG_ACTIVE) {
+        if (lru_cache.active_head == node) lru_cache.active_head = node->next;
 
-        active_curr = active_curr->next;
-    }
+        list_remove(&lru_cache.active_tail, node);
 
-    lru_page_t *inactive_curr = lru_cache.inactive_head;
+        lru_cache.active--;
+    } else {
+        if (lru_cache.inactive_head == node) lru_cache.inactive_head = node->next;
 
-    while (inactive_curr != NULL) {
-        if (inactive_curr->virt_addr == virt_addr) {
-            list_remove(&lru_cache.inactive_tail, inactive_curr);
+        list_remove(&lru_cache.inactive_tail, node);
 
-            // Free lru cache node
-            kfree(inactive_curr, sizeof(lru_page_t));
+        lru_cache.inactive--;
+    }
 
-            return;
-        }
+    page->flags &= ~(PG_LRU | PG_ACTIVE);
+    page->lru = NULL;
 
-        inactive_curr = inactive_curr->next;
-    }
+    // Free lru cache node
+    kmem_cache_free(lru_page_cache, node);
 }
\ No newline at end of file
@@ -1,29 +1,63 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <stdio.h>
 
 #include <memory.h>
 #include <multiboot.h>
 
 static uint32_t round_pow2(uint32_t);
-static uint8_t get_order(uint32_t);
-static uint32_t get_bit_tree_index(uint32_t, uint8_t);
-static uint8_t get_state(uint32_t, uint8_t);
-static void set_state(uint32_t, uint8_t, uint8_t);
-static void free_list_append(uint32_t, uint8_t);
-static void free_list_remove(uint32_t, uint8_t);
-static uint8_t split(uint8_t, uint8_t);
-static void mark_free(uint32_t, uint32_t);
+static uint8_t get_order(phys_addr_t);
+static uint32_t get_bit_tree_index(phys_addr_t, uint8_t);
+static uint8_t get_state(phys_addr_t, uint8_t);
+static void set_state(phys_addr_t, uint8_t, uint8_t);
+static void set_state_range(phys_addr_t, uint8_t, uint32_t, uint8_t);
+static void free_list_append(phys_addr_t, uint8_t);
+static void free_list_remove(phys_addr_t, uint8_t);
+static uint8_t get_migratetype(phys_addr_t);
+static void claim_pageblock(phys_addr_t, uint8_t);
+static phys_addr_t take_block(uint8_t, uint8_t);
+static void split(phys_addr_t, uint8_t, uint8_t);
+static void set_allocated(phys_addr_t, uint8_t);
+static void free_block(phys_addr_t, uint8_t);
+static void mark_free(phys_addr_t, phys_addr_t);
+static void free_range(phys_addr_t, uint32_t);
+static uint8_t get_region(mmap_entry_t *, phys_addr_t *, phys_addr_t *);
+static uint32_t find_region(uint32_t, uint32_t, uint32_t, uint32_t);
+static uint8_t is_movable(page_t *);
+static phys_addr_t find_compact_target(uint8_t);
+static uint8_t evacuate(phys_addr_t, uint8_t);
+static uint8_t compact(uint8_t);
+static uint32_t min_watermark();
+static phys_addr_t take_zeroed(uint8_t);
 
 extern char kernel_start;
 extern char kernel_len;
 
-// Known used regions 
-#define NUM_USED_REGIONS 2
+// Known used regions, allocator metadata is filled in by pmm_init
+#define NUM_USED_REGIONS 4
 static uintptr_t used_regions[NUM_USED_REGIONS][2] = {
     {(uintptr_t)&kernel_start, (uintptr_t)&kernel_len}, // Kernel
-    {0xB80000, 8000}                                    // VGA memory
+    {0xB8000, 8000},                                    // VGA memory
+    {0, PAGE_SIZE},                                     // Page 0, an address of 0 is an allocation failure
+    {0, 0}                                              // Frame descriptors and bit tree
 };
 
+// Types to steal from when a migrate type has no free blocks, in order of preference
+static const uint8_t fallbacks[MIGRATE_TYPES][MIGRATE_TYPES - 1] = {
+    {MIGRATE_RECLAIMABLE, MIGRATE_MOVABLE},   // Unmovable
+    {MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE}, // Movable
+    {MIGRATE_UNMOVABLE, MIGRATE_MOVABLE}      // Reclaimable
+};
+
+static const char *migratetype_names[MIGRATE_TYPES] = {"Unmovable", "Movable", "Reclaimable"};
+
+// Fragmentation steps of pmm_benchmark, and the allocations timed at each
+#define BENCHMARK_STEPS 8
+#define BENCHMARK_ALLOCS 64
+
+// Order of the larger blocks timed by pmm_benchmark
+#define BENCHMARK_ORDER 3
+
 buddy_t pmm __attribute__((section(".buddy_allocator")));
 
 /**
@@ -57,9 +91,9 @@ static uint32_t round_pow2(uint32_t length) {
  * @param length The size of the memory block (in bytes).
  * @return The order value (0 to MAX_ORDER) corresponding to the block size.
  */
-static uint8_t get_order(uint32_t length) {
+static uint8_t get_order(phys_addr_t length) {
     for (int n = MAX_BLOCK_LOG2; n >= MIN_BLOCK_LOG2; n--) {
-        if ((unsigned)(1 << n) <= length) return n - MIN_BLOCK_LOG2;
+        if ((phys_addr_t)1 << n <= length) return n - MIN_BLOCK_LOG2;
     }
     return 0;
 }
@@ -75,10 +109,10 @@ static uint8_t get_order(uint32_t length) {
  * @param order The order of the memory block.
  * @return The index of the block in the bit tree array.
  */
-static uint32_t get_bit_tree_index(uint32_t address, uint8_t order) {
-    uint8_t height = MEM_BLOCK_LOG2 - order - MIN_BLOCK_LOG2;
-    uint32_t offset = (address - pmm.base) / (1 << (MIN_BLOCK_LOG2 + order));
-    uint32_t node_index = (1 << height) - 1 + offset - TRUNCATED_TREE_NODES;
+static uint32_t get_bit_tree_index(phys_addr_t address, uint8_t order) {
+    uint8_t height = pmm.tree_log2 - order - MIN_BLOCK_LOG2;
+    uint32_t offset = (address - pmm.base) >> (MIN_BLOCK_LOG2 + order);
+    uint32_t node_index = (1 << height) - 1 + offset - TRUNCATED_TREE_NODES(pmm.tree_log2);
 
     return node_index;
 }
@@ -93,7 +127,7 @@ static uint32_t get_bit_tree_index(uint32_t address, uint8_t order) {
  * @param order The order of the memory block.
  * @return The state bit value (0 for free, 1 for allocated/split).
  */
-static uint8_t get_state(uint32_t address, uint8_t order) {
+static uint8_t get_state(phys_addr_t address, uint8_t order) {
     uint32_t index = get_bit_tree_index(address, order);
     uint32_t word_index = index / 32;
     uint32_t word_offset = index % 32;
@@ -115,7 +149,7 @@ static uint8_t get_state(uint32_t address, uint8_t order) {
  * @param order The order of the memory block.
  * @param state The state value to set (0 for free, 1 for allocated/split).
  */
-static void set_state(uint32_t address, uint8_t order, uint8_t state) {
+static void set_state(phys_addr_t address, uint8_t order, uint8_t state) {
     uint32_t index = get_bit_tree_index(address, order);
     uint32_t word_index = index / 32;
     uint32_t word_offset = index % 32;
@@ -126,107 +160,312 @@ static void set_state(uint32_t address, uint8_t order, uint8_t state) {
     pmm.bit_tree[word_index] = (pmm.bit_tree[word_index] & mask) | state << word_offset;
 }
 
+/**
+ * @brief Sets the state of consecutive memory blocks of the same order.
+ *
+ * Blocks of one order that are next to each other in memory are also next to
+ * each other in the bit tree, so the bits are updated a word at a time.
+ *
+ * @param address The physical address of the first memory block.
+ * @param order The order of the memory blocks.
+ * @param count The number of memory blocks.
+ * @param state The state value to set (0 for free, 1 for allocated/split).
+ */
+static void set_state_range(phys_addr_t address, uint8_t order, uint32_t count, uint8_t state) {
+    uint32_t index = get_bit_tree_index(address, order);
+    uint32_t end = index + count;
+
+    while (index < end) {
+        uint32_t word_index = index / 32;
+        uint32_t word_offset = index % 32;
+
+        uint32_t bits = 32 - word_offset;
+        if (bits > end - index) bits = end - index;
+
+        // Create a mask covering the target bits in this word
+        uint32_t mask = (bits == 32 ? 0xFFFFFFFF : (1u << bits) - 1) << word_offset;
+
+        if (state) pmm.bit_tree[word_index] |= mask;
+        else pmm.bit_tree[word_index] &= ~mask;
+
+        index += bits;
+    }
+}
+
 /**
  * @brief Adds a memory block to the free list of its order.
  *
  * This function inserts a memory block at the head of the free list
- * corresponding to its order. The block is accessed through its higher half
- * virtual address.
+ * corresponding to its order and the migrate type of its pageblock, and marks
+ * the order as available in the free mask of that type. The block's first
+ * frame descriptor records the order and is flagged as a free buddy block.
  *
  * @param address The physical address of the memory block to add.
  * @param order The order of the memory block.
  */
-static void free_list_append(uint32_t address, uint8_t order) {
-    buddy_block_t *block = (buddy_block_t *)(address + 0xC0000000);
+static void free_list_append(phys_addr_t address, uint8_t order) {
+    page_t *block = pmm_get_page(address);
+
+    uint8_t type = get_migratetype(address);
+
+    block->order = order;
+    block->flags = PG_BUDDY;
 
-    if (pmm.free_lists[order]) pmm.free_lists[order]->prev = block;
+    if (pmm.free_lists[type][order]) pmm.free_lists[type][order]->prev = block;
 
     block->prev = NULL;
-    block->next = pmm.free_lists[order];
+    block->next = pmm.free_lists[type][order];
 
-    pmm.free_lists[order] = block;
+    pmm.free_lists[type][order] = block;
+    pmm.free_mask[type] |= 1 << order;
+    pmm.nr_free[type][order]++;
 }
 
 /**
  * @brief Removes a memory block from the free list of its order.
  *
  * This function extracts a memory block from its free list by updating the next
- * and previous pointers of adjacent blocks.
+ * and previous pointers of adjacent blocks. If the list becomes empty, the
+ * order is cleared from the free mask of the block's migrate type.
  *
  * @param address The physical address of the memory block to remove.
  * @param order The order of the memory block.
  */
-static void free_list_remove(uint32_t address, uint8_t order) {
-    buddy_block_t *block = (buddy_block_t *)(address + 0xC0000000);
+static void free_list_remove(phys_addr_t address, uint8_t order) {
+    page_t *block = pmm_get_page(address);
+
+    uint8_t type = get_migratetype(address);
+
+    block->flags &= ~PG_BUDDY;
 
     if (block->prev != NULL) block->prev->next = block->next;
 
-    if (pmm.free_lists[order] == block) pmm.free_lists[order] = block->next;
+    if (pmm.free_lists[type][order] == block) pmm.free_lists[type][order] = block->next;
 
     if (block->next != NULL) block->next->prev = block->prev;
 
+    if (pmm.free_lists[type][order] == NULL) pmm.free_mask[type] &= ~(1 << order);
+
+    pmm.nr_free[type][order]--;
+
     block->prev = NULL;
     block->next = NULL;
 }
 
+/**
+ * @brief Gets the migrate type of the pageblock containing an address.
+ *
+ * @param address A physical address.
+ * @return The migrate type of the pageblock.
+ */
+static uint8_t get_migratetype(phys_addr_t address) {
+    return pmm.pageblock_types[(address - pmm.base) >> MAX_BLOCK_LOG2];
+}
+
+/**
+ * @brief Changes the migrate type of a pageblock.
+ *
+ * Free blocks are kept on the free lists of their pageblock's type, so all
+ * free blocks in the pageblock are moved to the lists of @p migratetype. The
+ * pageblock is walked by frame descriptor, skipping over free blocks.
+ *
+ * @param address A physical address within the pageblock.
+ * @param migratetype The new migrate type of the pageblock.
+ */
+static void claim_pageblock(phys_addr_t address, uint8_t migratetype) {
+    uint32_t index = (address - pmm.base) >> MAX_BLOCK_LOG2;
+    uint8_t old_type = pmm.pageblock_types[index];
+
+    if (old_type == migratetype) return;
+
+    phys_addr_t base = ((phys_addr_t)index << MAX_BLOCK_LOG2) + pmm.base;
+    page_t *pages = pmm_get_page(base);
+
+    for (uint32_t i = 0; i < PAGEBLOCK_PAGES && &pages[i] < pmm.pages + pmm.num_pages;) {
+        if (!(pages[i].flags & PG_BUDDY)) {
+            i++;
+            continue;
+        }
+
+        uint8_t order = pages[i].order;
+
+        // The free lists are picked by the pageblock type, so switch it around the move
+        free_list_remove(base + i * PAGE_SIZE, order);
+        pmm.pageblock_types[index] = migratetype;
+        free_list_append(base + i * PAGE_SIZE, order);
+        pmm.pageblock_types[index] = old_type;
+
+        i += 1 << order;
+    }
+
+    pmm.pageblock_types[index] = migratetype;
+}
+
+/**
+ * @brief Takes a free block for an allocation and splits it to size.
+ *
+ * This function takes the best fit free block of @p migratetype. If that type
+ * has no block large enough, the largest block of the first fallback type that
+ * has one is stolen instead, which keeps the number of pageblocks that end up
+ * with mixed types low. When the stolen block is at least half a pageblock, or
+ * the allocation is not movable, the whole pageblock is claimed for
+ * @p migratetype so later allocations of that type are grouped into it. The
+ * block is removed from its free list and split down to @p order.
+ *
+ * @param order The order of the block needed.
+ * @param migratetype The migrate type of the allocation.
+ * @return The physical address of the block, or 0 if no block is available.
+ */
+static phys_addr_t take_block(uint8_t order, uint8_t migratetype) {
+    uint8_t type = migratetype;
+
+    // Only keep orders that can satisfy the request
+    uint32_t available = pmm.free_mask[type] & ~((1 << order) - 1);
+
+    if (available == 0) {
+        for (int i = 0; i < MIGRATE_TYPES - 1 && available == 0; i++) {
+            type = fallbacks[migratetype][i];
+            available = pmm.free_mask[type] & ~((1 << order) - 1);
+        }
+
+        if (available == 0) return 0;
+
+        // Steal the largest block
+        uint8_t found = 31 - __builtin_clz(available);
+        phys_addr_t address = pmm_page_address(pmm.free_lists[type][found]);
+
+        if (found >= MAX_ORDER / 2 || migratetype != MIGRATE_MOVABLE) {
+            claim_pageblock(address, migratetype);
+            type = migratetype;
+        }
+
+        available = 1 << found;
+    }
+
+    // Lowest available order is the best fit (bsf)
+    uint8_t found = __builtin_ctz(available);
+
+    phys_addr_t address = pmm_page_address(pmm.free_lists[type][found]);
+
+    free_list_remove(address, found);
+
+    // A best fit block was not available - split the larger block
+    split(address, found, order);
+
+    return address;
+}
+
 /**
  * @brief Splits a memory block down to the target order.
  *
- * This function recursively divides a memory block into smaller buddy blocks
- * until the target order is reached. At each split, the parent block is
- * removed from its free list, marked as split in the bit tree, and both
- * resulting buddy blocks are added to the free list of the next lower order.
- * The buddy address is calculated using XOR operations.
+ * This function divides a memory block, already removed from its free list,
+ * into smaller buddy blocks until the target order is reached. At each level
+ * the block is marked as split in the bit tree and only its upper buddy is
+ * added to the free list of the next lower order. The lower half is carried
+ * down to the next level, so no free list is read while splitting. The buddy
+ * address is calculated using XOR operations.
  *
+ * @param address The physical address of the block to split.
  * @param order The current order of the block to split.
  * @param target The desired order after splitting.
- * @return The final order after splitting, or MAX_ORDER + 1 on error.
  */
-static uint8_t split(uint8_t order, uint8_t target) {
+static void split(phys_addr_t address, uint8_t order, uint8_t target) {
     while (order > target) {
-        buddy_block_t *block = pmm.free_lists[order];
-
-        uint32_t address = (uint32_t)block - 0xC0000000;
-        uint32_t buddy_address = ((address - pmm.base) ^ 1 << (order - 1 + MIN_BLOCK_LOG2)) + pmm.base;
-
-        free_list_remove(address, order);
-
         // Mark the parent block as split in the bit tree
         set_state(address, order, 1);
 
         order--;
 
-        // Add both buddies to free lists and mark them as free in the bit tree
-        free_list_append(address, order);
-        set_state(address, order, 0);
+        // Add the upper buddy to the free lists and mark it as free in the bit tree
+        phys_addr_t buddy_address = ((address - pmm.base) ^ 1 << (order + MIN_BLOCK_LOG2)) + pmm.base;
 
         free_list_append(buddy_address, order);
         set_state(buddy_address, order, 0);
+    }
+}
 
-        if (order == target) return order;
+/**
+ * @brief Records an allocated block in its frame descriptor.
+ *
+ * @param address The physical address of the allocated block.
+ * @param order The order of the allocated block.
+ */
+static void set_allocated(phys_addr_t address, uint8_t order) {
+    page_t *page = pmm_get_page(address);
+
+    page->order = order;
+    page->refcount = 1;
+    page->flags = 0;
+    page->private = 0;
+    page->mapping = 0;
+}
+
+/**
+ * @brief Returns a block to the buddy allocator.
+ *
+ * This function returns a memory block to the buddy allocator and attempts to
+ * merge it with its buddy if the buddy is also free. Merging continues while
+ * both buddies remain free, with the merged block starting at the lower of the
+ * two buddies. The final merged block is added to the appropriate free list and
+ * marked as free in the bit tree.
+ *
+ * @param address The physical address of the memory block to free.
+ * @param order The order of the memory block.
+ */
+static void free_block(phys_addr_t address, uint8_t order) {
+    uint8_t state = get_state(address, order);
+
+    if (state == 0) return; // TODO: implement better error handlng. page fault?
+
+    pmm_get_page(address)->refcount = 0;
+
+    pmm.free += 1 << (order + MIN_BLOCK_LOG2);
+
+    // Mark block as free in the bit tree
+    set_state(address, order, 0);
+
+    // Merge while the buddy is also free
+    while (order < MAX_ORDER) {
+        phys_addr_t buddy_address = ((address - pmm.base) ^ 1 << (order + MIN_BLOCK_LOG2)) + pmm.base;
+
+        // Buddy is either split or allocated - stop merging
+        if (get_state(buddy_address, order) != 0) break;
+
+        free_list_remove(buddy_address, order);
+
+        // The merged block starts at the lower buddy
+        if (buddy_address < address) address = buddy_address;
+
+        order++;
+
+        // Mark the parent block as free in the bit tree
+        set_state(address, order, 0);
     }
-    return MAX_ORDER + 1;
+
+    // Add the final, merged block back to free lists
+    free_list_append(address, order);
 }
 
 /**
  * @brief Marks a region of memory as free and adds it to the allocator.
  *
- * This function processes a memory region by filtering out known used regions,
- * creating higher-half linear mappings, and adding free blocks to the buddy
- * allocator's free lists. Free memory regions are divided into order-sized
- * blocks, and each block is marked as 1 (free) in the bit tree.
+ * This function processes a memory region by filtering out known used regions
+ * and adding free blocks to the buddy allocator's free lists. Free memory
+ * regions are divided into order-sized blocks, each aligned to its own size so
+ * buddy addresses can be calculated, and each block is marked as 0 (free) in
+ * the bit tree.
  *
  * @param base The starting physical address of the memory region.
  * @param length The size of the memory region (in bytes).
  */
-static void mark_free(uint32_t base, uint32_t length) {
+static void mark_free(phys_addr_t base, phys_addr_t length) {
     if (length == 0) return;
 
     // Filter out used regions
     for (int i = 0; i < NUM_USED_REGIONS; i++) {
         uint32_t used_end = used_regions[i][0] + used_regions[i][1];
 
-        uint32_t end = base + length;
+        phys_addr_t end = base + length;
 
         if (used_regions[i][0] >= base && used_end <= end) {
             mark_free(base, used_regions[i][0] - base);
@@ -236,24 +475,32 @@ static void mark_free(uint32_t base, uint32_t length) {
         }
     }
 
-    // Create linear mappings of addresses to address + 0xC0000000
-    uint32_t addr = base;
-    uint32_t unmapped_length = length;
-    
-    while (unmapped_length >= PAGE_SIZE) {
-        vmm_map(addr + 0xC0000000, addr, 0x3);
+    // Only whole pages can be added to the allocator
+    uint32_t offset = (PAGE_SIZE - (base & (PAGE_SIZE - 1))) & (PAGE_SIZE - 1);
+
+    if (length <= offset) return;
+
+    base += offset;
+    length -= offset;
 
-        addr += PAGE_SIZE;
-        unmapped_length -= PAGE_SIZE;
-    }
-    
     // Add memory to free lists to mark as free
     while (length >= PAGE_SIZE) {
         uint8_t order = get_order(length);
 
-        uint32_t block_size = 2 << (order + 11);
+        // Limit the block to the alignment of its address, blocks never span more than the low 32 bits
+        uint32_t block_offset = base - pmm.base;
+
+        if (block_offset != 0 && (uint8_t)(__builtin_ctz(block_offset) - MIN_BLOCK_LOG2) < order) {
+            order = __builtin_ctz(block_offset) - MIN_BLOCK_LOG2;
+        }
+
+        uint32_t block_size = 1 << (order + MIN_BLOCK_LOG2);
 
         pmm.free += block_size;
+
+        for (uint32_t i = 0; i < (1u << order); i++) {
+            pmm.pages[(base - pmm.base) / PAGE_SIZE + i].flags = 0;
+        }
         
         free_list_append(base, order);
 
@@ -264,17 +511,298 @@ static void mark_free(uint32_t base, uint32_t length) {
     }
 }
 
+/**
+ * @brief Frees a physically contiguous range of single pages.
+ *
+ * This function returns @p pages pages starting at @p address to the buddy
+ * allocator as the largest blocks that are aligned and fit in the range. The
+ * pages must have been handed out as single pages, with every level of the bit
+ * tree above them marked as split or allocated.
+ *
+ * @param address The physical address of the first page.
+ * @param pages The number of pages to free.
+ */
+static void free_range(phys_addr_t address, uint32_t pages) {
+    while (pages > 0) {
+        uint8_t order = 31 - __builtin_clz(pages);
+        if (order > MAX_ORDER) order = MAX_ORDER;
+
+        // Limit the block to the alignment of its address, blocks never span more than the low 32 bits
+        uint32_t offset = address - pmm.base;
+
+        if (offset != 0 && (uint8_t)(__builtin_ctz(offset) - MIN_BLOCK_LOG2) < order) {
+            order = __builtin_ctz(offset) - MIN_BLOCK_LOG2;
+        }
+
+        free_block(address, order);
+
+        address += 1 << (order + MIN_BLOCK_LOG2);
+        pages -= 1 << order;
+    }
+}
+
+/**
+ * @brief Reads a usable memory region from a memory map entry.
+ *
+ * Available and ACPI reclaimable entries are treated as usable. Regions that
+ * start above PHYS_LIMIT are ignored, and regions that cross it are truncated
+ * to PHYS_LIMIT. Without PAE that is the last page below 4 GiB, with PAE it is
+ * 16 GiB.
+ *
+ * @param mmap_entry Pointer to the memory map entry.
+ * @param base Set to the starting physical address of the region.
+ * @param length Set to the size of the region (in bytes).
+ * @return 1 if the entry describes usable memory, 0 otherwise.
+ */
+static uint8_t get_region(mmap_entry_t *mmap_entry, phys_addr_t *base, phys_addr_t *length) {
+    // TODO: Type 3 is ACPI reclimable memory, ACPI data needs to be processed first
+    if (mmap_entry->type != 1 && mmap_entry->type != 3) return 0;
+
+    uint64_t start = ((uint64_t)mmap_entry->base_addr_high << 32) | mmap_entry->base_addr_low;
+
+    if (start >= PHYS_LIMIT) return 0;
+
+    uint64_t end = start + (((uint64_t)mmap_entry->length_high << 32) | mmap_entry->length_low);
+
+    if (end > PHYS_LIMIT) end = PHYS_LIMIT;
+
+    *base = start;
+    *length = end > start ? end - start : 0;
+
+    return 1;
+}
+
+/**
+ * @brief Finds room for the allocator metadata in the memory map.
+ *
+ * This function searches the usable memory regions for the first place after
+ * the kernel image that can hold @p length bytes. The whole region must lie
+ * within the linear mapping.
+ *
+ * @param mmap_addr The physical address of the multiboot memory map.
+ * @param mmap_length The length of the memory map (in bytes).
+ * @param length The size of the metadata (in bytes).
+ * @param linear_end The end of the linearly mapped physical memory.
+ * @return The physical address of the metadata, or 0 if no region fits.
+ */
+static uint32_t find_region(uint32_t mmap_addr, uint32_t mmap_length, uint32_t length, uint32_t linear_end) {
+    uint32_t kernel_end = used_regions[0][0] + used_regions[0][1];
+
+    mmap_entry_t *mmap_entry = (mmap_entry_t *)mmap_addr;
+
+    while ((uint32_t)mmap_entry < mmap_addr + mmap_length) {
+        phys_addr_t base;
+        phys_addr_t region_length;
+
+        // The metadata must be linearly mapped, so only memory below linear_end can hold it
+        if (get_region(mmap_entry, &base, &region_length) && base < linear_end) {
+            uint32_t start = base < kernel_end ? kernel_end : base;
+            start = (start + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+            phys_addr_t end = base + region_length;
+
+            if (start < end && end - start >= length && start + length <= linear_end) {
+                return start;
+            }
+        }
+
+        // Add memory map entry size + size field
+        mmap_entry = (mmap_entry_t *)((uint32_t)mmap_entry + mmap_entry->size + sizeof(mmap_entry->size));
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Checks whether an allocated page can be migrated by compaction.
+ *
+ * Only single pages that are reached through one known mapping can be moved.
+ * Pages on the LRU cache are left alone, since their LRU nodes also refer to
+ * the page.
+ *
+ * @param page The frame descriptor of the first page of an allocated block.
+ * @return 1 if the page can be migrated, 0 otherwise.
+ */
+static uint8_t is_movable(page_t *page) {
+    return (page->flags & (PG_MOVABLE | PG_LRU)) == PG_MOVABLE && page->order == 0 && page->refcount == 1;
+}
+
+/**
+ * @brief Finds the cheapest block of memory to compact.
+ *
+ * Every aligned block of @p order is scanned through the frame descriptors.
+ * Pageblocks always start at a block boundary, so the scan steps from block
+ * to block by the order stored in each first page. Blocks holding any page
+ * that cannot be migrated are skipped. Of the rest, the block with the fewest
+ * pages to migrate is chosen, as long as enough free memory is left outside
+ * it to migrate them to.
+ *
+ * @param order The order of the block needed.
+ * @return The physical address of the block to compact, or 0 if no block can
+ *         be compacted.
+ */
+static phys_addr_t find_compact_target(uint8_t order) {
+    uint32_t num_pageblocks = (pmm.num_pages + PAGEBLOCK_PAGES - 1) / PAGEBLOCK_PAGES;
+    uint32_t free_pages = pmm.free / PAGE_SIZE;
+
+    phys_addr_t target = 0;
+    uint32_t target_cost = 0xFFFFFFFF;
+
+    for (uint32_t block = 0; block < num_pageblocks; block++) {
+        phys_addr_t base = ((phys_addr_t)block << MAX_BLOCK_LOG2) + pmm.base;
+        page_t *pages = pmm_get_page(base);
+        uint32_t i = 0;
+
+        while (i < PAGEBLOCK_PAGES) {
+            uint32_t end = i + (1 << order);
+            uint32_t cost = 0;
+            uint32_t free = 0;
+
+            while (i < end) {
+                page_t *page = &pages[i];
+
+                // Pages past the end of memory cannot be compacted into
+                if (page >= pmm.pages + pmm.num_pages) break;
+
+                if (page->flags & PG_BUDDY) {
+                    free += 1 << page->order;
+                    i += 1 << page->order;
+                } else if (is_movable(page)) {
+                    cost++;
+                    i++;
+                } else {
+                    break;
+                }
+            }
+
+            if (i >= end && cost > 0 && cost < target_cost && cost <= free_pages - free) {
+                target = base + (end - (1 << order)) * PAGE_SIZE;
+                target_cost = cost;
+            }
+
+            // Skip the rest of a block that cannot be compacted
+            if (i < end) {
+                page_t *page = &pages[i];
+
+                if (page < pmm.pages + pmm.num_pages && !(page->flags & PG_RESERVED)) i += 1 << page->order;
+
+                // Round up to the next block of the requested order
+                i = (i + (1 << order) - 1) & ~((1 << order) - 1);
+                if (i < end) i = end;
+            }
+        }
+    }
+
+    return target;
+}
+
+/**
+ * @brief Migrates all movable pages out of a block and frees it.
+ *
+ * The free blocks inside the block are isolated first: they are taken off the
+ * free lists and marked as allocated, so they can neither be handed out as
+ * migration targets nor be merged while pages are being moved. Each movable
+ * page is then copied to a newly allocated page outside the block and its
+ * page table entry is updated by the virtual memory manager. Finally the
+ * isolated blocks and the old pages are freed, which merges them back into
+ * one free block. If memory runs out part way, the pages moved so far stay
+ * moved and the rest of the block is left as it was.
+ *
+ * @param address The physical address of the block.
+ * @param order The order of the block.
+ * @return 1 if every page was migrated, 0 otherwise.
+ */
+static uint8_t evacuate(phys_addr_t address, uint8_t order) {
+    page_t *pages = pmm_get_page(address);
+    uint32_t count = 1 << order;
+    uint8_t moved_all = 1;
+
+    // Isolate the free blocks
+    for (uint32_t i = 0; i < count; i += 1 << pages[i].order) {
+        page_t *page = &pages[i];
+
+        if (!(page->flags & PG_BUDDY)) continue;
+
+        phys_addr_t block = address + i * PAGE_SIZE;
+        uint8_t block_order = page->order;
+
+        free_list_remove(block, block_order);
+        set_state(block, block_order, 1);
+        set_allocated(block, block_order);
+
+        page->flags = PG_ISOLATED;
+
+        pmm.free -= 1 << (block_order + MIN_BLOCK_LOG2);
+    }
+
+    // Migrate the movable pages
+    for (uint32_t i = 0; i < count; i += 1 << pages[i].order) {
+        page_t *page = &pages[i];
+
+        if (!is_movable(page)) continue;
+
+        phys_addr_t new_address = pmm_malloc(PAGE_SIZE, MIGRATE_MOVABLE);
+
+        if (new_address == 0) {
+            moved_all = 0;
+            break;
+        }
+
+        vmm_migrate_page(page->mapping, new_address);
+
+        page_t *new_page = pmm_get_page(new_address);
+
+        new_page->flags = page->flags;
+        new_page->mapping = page->mapping;
+
+        page->flags = PG_ISOLATED;
+        page->mapping = 0;
+    }
+
+    // Free the isolated blocks and the migrated pages - merges only involve blocks already freed
+    for (uint32_t i = 0; i < count;) {
+        page_t *page = &pages[i];
+        uint8_t block_order = page->order;
+
+        if (page->flags & PG_ISOLATED) free_block(address + i * PAGE_SIZE, block_order);
+
+        i += 1 << block_order;
+    }
+
+    return moved_all;
+}
+
+/**
+ * @brief Compacts memory to create a free block of the given order.
+ *
+ * @param order The order of the free block needed.
+ * @return 1 if a block was compacted, 0 otherwise.
+ */
+static uint8_t compact(uint8_t order) {
+    phys_addr_t target = find_compact_target(order);
+
+    if (target == 0) return 0;
+
+    return evacuate(target, order);
+}
+
 /**
  * @brief Initializes the physical memory manager and buddy allocator.
  *
  * This function sets up the physical memory manager using the multiboot memory
- * map to discover usable memory regions. It initializes the bit tree to all 1
- * (allocated), initializes the free lists, and processes memory map entries to
- * mark available regions as free.
+ * map to discover usable memory regions. The bit tree and the free list links
+ * are sized from the highest usable address and carved from the first usable
+ * region after the kernel, together with the page table needed to extend the
+ * linear mapping of physical memory up to LINEAR_MAP_LIMIT. The metadata must
+ * be linearly mapped, so if no such region can hold it, memory above the
+ * linear mapping is dropped from the top until it fits. It initializes the
+ * bit tree to all 1 (allocated), initializes the free lists, and processes
+ * memory map entries to mark available regions as free.
  *
  * @param mmap_addr The physical address of the multiboot memory map.
  * @param mmap_length The length of the memory map (in bytes).
- * @return The last virtual address used for linear mapping plus a one-page gap.
+ * @return The last virtual address used for linear mapping plus a one-page gap,
+ *         or 0 if there is no room for the allocator metadata.
  */
 uint32_t pmm_init(uint32_t mmap_addr, uint32_t mmap_length) {
     pmm.base = 0; 
@@ -282,182 +810,596 @@ uint32_t pmm_init(uint32_t mmap_addr, uint32_t mmap_length) {
     pmm.free = 0;
 
     // Ensure regions are a power of 2, if not round it up
-    for (int i = 0; i < NUM_USED_REGIONS; i++) {
+    for (int i = 0; i < NUM_USED_REGIONS - 1; i++) {
         if ((used_regions[i][1] & (used_regions[i][1] - 1)) != 0) {
             used_regions[i][1] = round_pow2(used_regions[i][1]);
         }
     }
 
+    // Find the highest usable address
+    phys_addr_t mem_end = 0;
+
+    mmap_entry_t *mmap_entry = (mmap_entry_t *)mmap_addr;
+
+    while ((uint32_t)mmap_entry < mmap_addr + mmap_length) {
+        phys_addr_t base;
+        phys_addr_t length;
+
+        if (get_region(mmap_entry, &base, &length) && base + length > mem_end) mem_end = base + length;
+
+        // Add memory map entry size + size field
+        mmap_entry = (mmap_entry_t *)((uint32_t)mmap_entry + mmap_entry->size + sizeof(mmap_entry->size));
+    }
+
+    // The bit tree covers the smallest power of 2 span that holds all usable memory
+    pmm.tree_log2 = MAX_BLOCK_LOG2;
+
+    while (pmm.tree_log2 < MAX_PHYS_LOG2 && ((uint64_t)1 << pmm.tree_log2) < mem_end) pmm.tree_log2++;
+
+    uint32_t linear_end = mem_end < LINEAR_MAP_LIMIT ? mem_end : LINEAR_MAP_LIMIT;
+
+    // Metadata layout: [linear mapping page table][frame descriptors][bit tree][pageblock types]
+    uint32_t pt_length = 0;
+
+    // The linear mapping uses large pages, only a partial large page at the end needs a page table
+    if (linear_end > BOOT_MAP_END && (linear_end & (LARGE_PAGE_SIZE - 1)) != 0) pt_length = PAGE_SIZE;
+
+    phys_addr_t usable_end = mem_end;
+    uint32_t tree_words, tree_length, num_pages, pages_length, num_pageblocks, meta_length, meta_base;
+
+    while (1) {
+        tree_words = TREE_WORDS(pmm.tree_log2);
+        tree_length = tree_words * sizeof(uint32_t);
+        num_pages = mem_end >> 12;
+        pages_length = num_pages * sizeof(page_t);
+        num_pageblocks = (num_pages + PAGEBLOCK_PAGES - 1) / PAGEBLOCK_PAGES;
+        meta_length = (pt_length + pages_length + tree_length + num_pageblocks + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+        meta_base = find_region(mmap_addr, mmap_length, meta_length, linear_end);
+
+        if (meta_base != 0 || mem_end <= linear_end) break;
+
+        // Halve the memory above the linear mapping, keeping whole maximum order blocks
+        mem_end = (linear_end + ((mem_end - linear_end) >> 1)) & ~(phys_addr_t)((1 << MAX_BLOCK_LOG2) - 1);
+
+        if (mem_end < linear_end) mem_end = linear_end;
+
+        while (pmm.tree_log2 > MAX_BLOCK_LOG2 && ((uint64_t)1 << (pmm.tree_log2 - 1)) >= mem_end) pmm.tree_log2--;
+    }
+
+    if (meta_base == 0) return 0;
+
+    if (mem_end < usable_end) {
+        printf("Memory above %d MiB is not managed, no region below %d MiB holds its metadata\n",
+               (uint32_t)(mem_end >> 20), linear_end >> 20);
+    }
+
+    used_regions[NUM_USED_REGIONS - 1][0] = meta_base;
+    used_regions[NUM_USED_REGIONS - 1][1] = meta_length;
+
+    // Create linear mappings of addresses to address + 0xC0000000
+    vmm_map_linear(linear_end, meta_base);
+
+    pmm.pages = (page_t *)(meta_base + pt_length + 0xC0000000);
+    pmm.bit_tree = (uint32_t *)((uint32_t)pmm.pages + pages_length);
+    pmm.pageblock_types = (uint8_t *)((uint32_t)pmm.bit_tree + tree_length);
+    pmm.num_pages = num_pages;
+
+    // All pageblocks start out movable, other types claim them as they need them
+    for (uint32_t i = 0; i < num_pageblocks; i++) {
+        pmm.pageblock_types[i] = MIGRATE_MOVABLE;
+    }
+
+    // Initialize frame descriptors - all pages are reserved until they are marked free
+    for (uint32_t i = 0; i < num_pages; i++) {
+        pmm.pages[i] = (page_t){0};
+        pmm.pages[i].flags = PG_RESERVED;
+    }
+
     // Initialize bit tree - all bits initially set to 1, only free blocks will be changed to 0
-    for (int i = 0; i < TREE_WORDS; i++) {
+    for (uint32_t i = 0; i < tree_words; i++) {
         pmm.bit_tree[i] = 0xFFFFFFFF;
     }
 
     // Initialize free lists
-    for (int i = 0; i <= MAX_ORDER; i++) {
-        pmm.free_lists[i] = NULL;
+    for (int type = 0; type < MIGRATE_TYPES; type++) {
+        for (int i = 0; i <= MAX_ORDER; i++) {
+            pmm.free_lists[type][i] = NULL;
+            pmm.nr_free[type][i] = 0;
+        }
+        pmm.free_mask[type] = 0;
     }
 
-    // Pointer to first memory map entry
-    mmap_entry_t *mmap_entry = (mmap_entry_t *)mmap_addr;
-
-    uint32_t addr_end = 0;
+    for (int type = 0; type < MIGRATE_TYPES; type++) {
+        pmm.zero_count[type] = 0;
+    }
 
-    while((uint32_t)mmap_entry < mmap_addr + mmap_length) {
-        uintptr_t base_addr = ((uint64_t)mmap_entry->base_addr_high << 32) | mmap_entry->base_addr_low;
-        uintptr_t length = ((uint64_t)mmap_entry->length_high << 32) | mmap_entry->length_low;
+    mmap_entry = (mmap_entry_t *)mmap_addr;
 
-        if (mmap_entry->type == 1) {
-            mark_free(base_addr, length);
+    while ((uint32_t)mmap_entry < mmap_addr + mmap_length) {
+        phys_addr_t base;
+        phys_addr_t length;
 
-            addr_end = base_addr + length;
-        } else if (mmap_entry->type == 3) {
-            // TODO: This is ACPI reclimable memory, ACPI data needs to be processed first
-            mark_free(base_addr, length);
+        // Memory left out of the managed range has no frame descriptors
+        if (get_region(mmap_entry, &base, &length) && base < mem_end) {
+            if (base + length > mem_end) length = mem_end - base;
 
-            addr_end = base_addr + length;
+            mark_free(base, length);
         }
 
         // Add memory map entry size + size field
         mmap_entry = (mmap_entry_t *)((uint32_t)mmap_entry + mmap_entry->size + sizeof(mmap_entry->size));
     }
 
+    pmm.size = pmm.free;
+
     // TODO: Mark areas used by boot modules (mods_*), other multiboot info needed
     
-    // TODO: Unmap the identiy mapping of the first 4 MiB of memory
-    
     // Return last virtual address used for linear mappings with a one-page gap
-    return addr_end + 0xC0001000;
+    if (linear_end < BOOT_MAP_END) linear_end = BOOT_MAP_END;
+
+    return linear_end + 0xC0001000;
 }
 
 /**
  * @brief Allocates a physical memory block of the requested size.
  *
  * This function finds and allocates a memory block from the buddy allocator
- * that satisfies the requested size. It first attempts to allocate a block of
- * the exact order requested. If unavailable, it searches for a larger block and
- * splits it to the required size. The allocated block is removed from its free
- * list and marked as used in the bit tree.
+ * that satisfies the requested size. The free mask of @p migratetype is masked
+ * down to the orders at or above the requested order, and the lowest set bit
+ * gives the best fit order directly. If the type has no such block, one is
+ * stolen from a fallback type. The block is removed from its free list, split
+ * down to the requested order if it is larger, and marked as used in the bit
+ * tree.
  *
  * @param length The size of memory to allocate (in bytes).
- * @return Pointer to the physical address of the allocated block, or NULL if
- *         allocation fails or length exceeds maximum block size.
+ * @param migratetype The mobility of the allocation (MIGRATE_TYPE).
+ * @return The physical address of the allocated block, or 0 if allocation
+ *         fails or length exceeds maximum block size.
  */
-uint32_t *pmm_malloc(uint32_t length) {
-    if (length > 1 << MAX_BLOCK_LOG2) return NULL;
+phys_addr_t pmm_malloc(uint32_t length, uint8_t migratetype) {
+    if (length > 1 << MAX_BLOCK_LOG2) return 0;
 
     uint8_t order = get_order(length);
 
     /*
     TODO: wake kswapd if free pages falls below low_watermark
-    uint32_t min_watermark = pmm.size / PAGE_SIZE / 128;
+    uint32_t free_pages = (pmm.free - (1 << order)) / PAGE_SIZE;
+
+    if (free_pages < pmm_low_watermark()) wake(kswapd)
+    */
+
+    phys_addr_t address = take_block(order, migratetype);
+
+    // Compaction can only help when more than one page is needed
+    if (address == 0 && order > 0 && compact(order)) address = take_block(order, migratetype);
+
+    // Out of memory - pages waiting in the zeroed pools are still usable
+    if (address == 0 && order == 0) return take_zeroed(migratetype);
+
+    if (address == 0) return 0;
+
+    // Mark block as used in the bit tree
+    set_state(address, order, 1);
+    set_allocated(address, order);
+
+    pmm.free -= 1 << (order + MIN_BLOCK_LOG2);
+
+    return address;
+}
+
+/**
+ * @brief Computes the minimum watermark of free pages.
+ *
+ * @return 1/128 of all pages, kept between 20 and 255 pages.
+ */
+static uint32_t min_watermark() {
+    uint32_t pages = pmm.size / PAGE_SIZE / 128;
+
     // 20 <= p <= 255, p = total free pages / 128
-    if (min_watermark < 20) min_watermark = 20;
-    else if (min_watermark > 255) min_watermark = 255;
+    if (pages < 20) pages = 20;
+    else if (pages > 255) pages = 255;
 
-    uint32_t low_watermark = min_watermark * 2;
+    return pages;
+}
 
-    uint32_t free_pages = (pmm.free - (1 << order)) / PAGE_SIZE;
+/**
+ * @brief Computes the low watermark of free pages.
+ *
+ * The low watermark is twice the minimum watermark. Below it, memory is
+ * reclaimed.
+ *
+ * @return The low watermark in pages.
+ */
+uint32_t pmm_low_watermark() {
+    return min_watermark() * 2;
+}
 
-    if (free_pages < low_watermark) wake(kswapd)
-    */
+/**
+ * @brief Computes the high watermark of free pages.
+ *
+ * The high watermark is three times the minimum watermark. Reclaim frees
+ * pages up to it.
+ *
+ * @return The high watermark in pages.
+ */
+uint32_t pmm_high_watermark() {
+    return min_watermark() * 3;
+}
 
-    // Block of the requested order is available - no need to split
-    if (pmm.free_lists[order] != NULL) {
-        buddy_block_t *block = pmm.free_lists[order];
+/**
+ * @brief Frees a previously allocated physical memory block.
+ *
+ * The order of the block is read from its frame descriptor, so the caller
+ * does not need to know the size of the allocation.
+ *
+ * @param address The physical address of the memory block to free.
+ */
+void pmm_free(phys_addr_t address) {
+    free_block(address, pmm_get_page(address)->order);
+}
 
-        uint32_t address = (uint32_t)block - 0xC0000000;
+/**
+ * @brief Allocates multiple 4 KiB physical pages in one pass.
+ *
+ * This function fills @p frames with the physical addresses of @p count
+ * pages. Rather than allocating one page at a time, it takes the best fit
+ * block for the remaining count (or the largest available block if none is
+ * big enough), splits it once and hands the whole block out as single pages.
+ * Every level of the bit tree below the block is marked as split or allocated,
+ * so each page can later be freed on its own. The pages are not guaranteed to
+ * be physically contiguous.
+ *
+ * @param count The number of pages to allocate.
+ * @param frames Array that receives the physical address of each page.
+ * @param migratetype The mobility of the pages (MIGRATE_TYPE).
+ * @return The number of pages allocated, less than @p count if memory ran out.
+ */
+uint32_t pmm_alloc_bulk(uint32_t count, phys_addr_t *frames, uint8_t migratetype) {
+    uint32_t filled = 0;
 
-        free_list_remove(address, order);
+    while (filled < count) {
+        uint32_t remaining = count - filled;
 
-        // Mark block as used in the bit tree
-        set_state(address, order, 1);
+        // Largest order that does not exceed the remaining pages
+        uint8_t order = 31 - __builtin_clz(remaining);
+        if (order > MAX_ORDER) order = MAX_ORDER;
+
+        phys_addr_t address = take_block(order, migratetype);
+
+        // No block is big enough - use the largest smaller block
+        while (address == 0 && order > 0) {
+            order--;
+            address = take_block(order, migratetype);
+        }
+
+        if (address == 0) break;
+
+        // Mark the block and every level below it as split or allocated in the bit tree
+        for (int i = order; i >= 0; i--) {
+            set_state_range(address, i, 1 << (order - i), 1);
+        }
 
         pmm.free -= 1 << (order + MIN_BLOCK_LOG2);
 
-        return (uint32_t *)address;
+        for (uint32_t i = 0; i < (1u << order); i++) {
+            set_allocated(address + i * PAGE_SIZE, 0);
+
+            frames[filled++] = address + i * PAGE_SIZE;
+        }
+    }
+
+    return filled;
+}
+
+/**
+ * @brief Frees multiple 4 KiB physical pages.
+ *
+ * This function returns @p count pages to the buddy allocator. Runs of pages
+ * in @p frames that are physically contiguous and aligned to a buddy block are
+ * freed together as one block instead of page by page.
+ *
+ * @param count The number of pages to free.
+ * @param frames Array holding the physical address of each page.
+ */
+void pmm_free_bulk(uint32_t count, phys_addr_t *frames) {
+    uint32_t i = 0;
+
+    while (i < count) {
+        phys_addr_t address = frames[i];
+        uint8_t order = 0;
+
+        // Grow the block while its buddy pages follow in the array
+        while (order < MAX_ORDER) {
+            uint32_t pages = 1 << (order + 1);
+
+            if (((address - pmm.base) & (pages * PAGE_SIZE - 1)) != 0 || i + pages > count) break;
+
+            uint32_t j = 1 << order;
+            while (j < pages && frames[i + j] == address + j * PAGE_SIZE) j++;
+
+            if (j < pages) break;
+
+            order++;
+        }
+
+        free_block(address, order);
+
+        i += 1 << order;
     }
+}
+
+/**
+ * @brief Allocates a physically contiguous region of exactly the requested size.
+ *
+ * This function rounds @p length up to whole pages and allocates a block of
+ * the next power of 2 pages. The block is handed out as single pages, and the
+ * unused pages at its tail are returned to the free lists straight away, so
+ * only the requested pages stay allocated. Exact regions are meant for
+ * physically addressed buffers, so they are always unmovable.
+ *
+ * @param length The size of memory to allocate (in bytes).
+ * @return The physical address of the allocated region, or 0 if allocation
+ *         fails or length exceeds maximum block size.
+ */
+phys_addr_t pmm_alloc_exact(uint32_t length) {
+    uint32_t pages = (length + PAGE_SIZE - 1) / PAGE_SIZE;
 
-    // A best fit block was not available - search for a larger block to split
-    for (int i = order + 1; i <= MAX_ORDER; i++) {
-        if (pmm.free_lists[i] != NULL) {
-            // A larger partition found, split
-            uint8_t next_order = split(i, order);
+    if (pages == 0 || pages > 1 << MAX_ORDER) return 0;
 
-            if (next_order == MAX_ORDER + 1) return NULL;
+    uint32_t block_length = round_pow2(pages) * PAGE_SIZE;
 
-            buddy_block_t *block = pmm.free_lists[next_order];
+    phys_addr_t address = pmm_malloc(block_length, MIGRATE_UNMOVABLE);
 
-            uint32_t address = (uint32_t)block - 0xC0000000;
+    if (address == 0) return 0;
 
-            free_list_remove(address, next_order);
+    uint8_t order = get_order(block_length);
 
-            // Mark block as used in the bit tree
-            set_state(address, next_order, 1);
+    // Mark every level below the block as split or allocated
+    for (int i = order - 1; i >= 0; i--) {
+        set_state_range(address, i, 1 << (order - i), 1);
+    }
+
+    for (uint32_t i = 0; i < (1u << order); i++) {
+        set_allocated(address + i * PAGE_SIZE, 0);
+    }
+
+    // The first frame descriptor remembers the size of the region
+    pmm_get_page(address)->private = pages;
 
-            pmm.free -= 1 << (next_order + MIN_BLOCK_LOG2);
+    // Give the unused tail back to the free lists
+    free_range(address + pages * PAGE_SIZE, (1 << order) - pages);
 
-            return (uint32_t *)address;
+    return address;
+}
+
+/**
+ * @brief Frees a region allocated with pmm_alloc_exact.
+ *
+ * The number of pages in the region is read from the frame descriptor of its
+ * first page.
+ *
+ * @param address The physical address of the region.
+ */
+void pmm_free_exact(phys_addr_t address) {
+    free_range(address, pmm_get_page(address)->private);
+}
+
+/**
+ * @brief Gets the frame descriptor of a physical page.
+ *
+ * @param address A physical address within the page.
+ * @return Pointer to the frame descriptor of the page.
+ */
+page_t *pmm_get_page(phys_addr_t address) {
+    return &pmm.pages[(uint32_t)((address - pmm.base) >> 12)];
+}
+
+/**
+ * @brief Gets the physical address of a page from its frame descriptor.
+ *
+ * @param page Pointer to the frame descriptor.
+ * @return The physical address of the page.
+ */
+phys_addr_t pmm_page_address(page_t *page) {
+    return (phys_addr_t)(page - pmm.pages) * PAGE_SIZE + pmm.base;
+}
+
+/**
+ * @brief Prints the number of free blocks per order for each migrate type.
+ *
+ * Watching how the counts change over time shows how fragmented each type is.
+ */
+void pmm_dump() {
+    printf("Free blocks per order (0 to %d):\n", MAX_ORDER);
+
+    for (int type = 0; type < MIGRATE_TYPES; type++) {
+        printf("%s:", migratetype_names[type]);
+
+        for (int i = 0; i <= MAX_ORDER; i++) {
+            printf(" %d", pmm.nr_free[type][i]);
         }
+
+        printf("\n");
     }
 
-    return NULL;
+    printf("Zeroed pools: %d %d %d\n", pmm.zero_count[MIGRATE_UNMOVABLE], pmm.zero_count[MIGRATE_MOVABLE], pmm.zero_count[MIGRATE_RECLAIMABLE]);
 }
 
 /**
- * @brief Frees a previously allocated physical memory block.
+ * @brief Measures allocation latency as physical memory fragments.
  *
- * This function returns a memory block to the buddy allocator and attempts to
- * merge it with its buddy if the buddy is also free. Merging continues while
- * both buddies remain free. The final merged block is added to the appropriate
- * free list and marked as free in the bit tree.
+ * At each of BENCHMARK_STEPS steps, BENCHMARK_ALLOCS blocks of order 0 and of
+ * order BENCHMARK_ORDER are allocated and freed again, and the cycles per
+ * allocation are read from the time stamp counter. Between steps the heap is
+ * fragmented further: a run of @p pages pages is taken from whole blocks with
+ * pmm_alloc_bulk and every other page is freed again, which leaves free pages
+ * that cannot merge with their buddies. The other pages are held until the
+ * end. Finding a block only takes a lookup in the free mask, so the latency
+ * should stay flat however many small free blocks pile up. All pages are
+ * movable, and any pageblock claimed on the way gets its old migrate type back
+ * at the end, so later allocations are grouped as before. No more than half
+ * of the free memory is held.
  *
- * @param address The physical address of the memory block to free.
- * @param length The size of the memory block (in bytes).
+ * @param pages The number of pages allocated at each fragmentation step,
+ *        rounded down to a power of 2.
  */
-void pmm_free(uint32_t address, uint32_t length) {
-    uint8_t order = get_order(length);
+void pmm_benchmark(uint32_t pages) {
+    phys_addr_t timed[BENCHMARK_ALLOCS];
+    uint32_t limit = (uint32_t)(pmm.free >> MIN_BLOCK_LOG2) / 2 / BENCHMARK_STEPS;
 
-    uint8_t state = get_state(address, order);
+    if (pages > limit) pages = limit;
+    if (pages < 2) return;
 
-    if (state == 0) return; // TODO: implement better error handlng. page fault?
+    pages = 1 << (31 - __builtin_clz(pages));
 
-    uint32_t buddy_address = ((address - pmm.base) ^ 1 << (order + MIN_BLOCK_LOG2)) + pmm.base;
-    uint8_t buddy_state = get_state(buddy_address, order);
+    uint32_t held_length = ((BENCHMARK_STEPS - 1) * pages / 2 + pages) * sizeof(phys_addr_t);
+    uint32_t num_pageblocks = (pmm.num_pages + PAGEBLOCK_PAGES - 1) / PAGEBLOCK_PAGES;
 
-    // Buddy is either split or allocated - immediately return the block to free lists
-    if (buddy_state == 1) {
-        free_list_append(address, order);
+    phys_addr_t *held = (phys_addr_t *)vmm_malloc(held_length + num_pageblocks, MIGRATE_UNMOVABLE);
 
-        // Mark block as free in the bit tree
-        set_state(address, order, 0);
+    if (held == NULL) return;
+
+    uint8_t *types = (uint8_t *)held + held_length;
+
+    for (uint32_t i = 0; i < num_pageblocks; i++) types[i] = pmm.pageblock_types[i];
+
+    uint32_t count = 0;
+
+    for (int step = 0; step < BENCHMARK_STEPS; step++) {
+        uint32_t cycles[2];
+
+        for (int run = 0; run < 2; run++) {
+            uint32_t length = run == 0 ? PAGE_SIZE : PAGE_SIZE << BENCHMARK_ORDER;
+
+            uint64_t start;
+            __asm__ volatile("rdtsc" : "=A"(start));
+
+            for (int i = 0; i < BENCHMARK_ALLOCS; i++) timed[i] = pmm_malloc(length, MIGRATE_MOVABLE);
+
+            uint64_t end;
+            __asm__ volatile("rdtsc" : "=A"(end));
+
+            cycles[run] = (uint32_t)(end - start) / BENCHMARK_ALLOCS;
 
-        pmm.free += 1 << (order + MIN_BLOCK_LOG2);
+            for (int i = 0; i < BENCHMARK_ALLOCS; i++) {
+                if (timed[i] != 0) pmm_free(timed[i]);
+            }
+        }
+
+        printf("Step %d: %d pages held, %d free order 0 blocks, %d cycles per order 0 allocation, %d per order %d\n",
+               step, count, pmm.nr_free[MIGRATE_MOVABLE][0], cycles[0], cycles[1], BENCHMARK_ORDER);
+
+        if (step == BENCHMARK_STEPS - 1) break;
+
+        // Hold every other page of a fresh run, so the pages in between cannot merge
+        uint32_t allocated = pmm_alloc_bulk(pages, held + count, MIGRATE_MOVABLE);
+
+        for (uint32_t i = 0; i < allocated; i++) {
+            if (i % 2 == 0) pmm_free(held[count + i]);
+            else held[count + i / 2] = held[count + i];
+        }
+
+        count += allocated / 2;
 
-        return;
+        if (allocated < pages) break;
     }
 
-    // Buddy is free - merge
-    while (order < MAX_ORDER) {
-        free_list_remove(buddy_address, order);
+    while (count > 0) pmm_free(held[--count]);
 
-        // Mark first buddy as free in the bit tree
-        set_state(address, order, 0);
+    for (uint32_t i = 0; i < num_pageblocks; i++) {
+        if (pmm.pageblock_types[i] != types[i]) claim_pageblock(((phys_addr_t)i << MAX_BLOCK_LOG2) + pmm.base, types[i]);
+    }
 
-        order++;
+    vmm_free((uint32_t)held);
+}
 
-        // Mark the parent block as free in the bit tree
-        set_state(address, order, 0);
+/**
+ * @brief Runs one pass of background compaction.
+ *
+ * This function is meant to be called while the kernel is idle, so that
+ * high-order allocations rarely have to compact synchronously. When there is
+ * enough free memory for at least two pageblocks but no pageblock is free as a
+ * whole, the cheapest pageblock is evacuated.
+ *
+ * @return 1 if a pageblock was compacted, 0 otherwise.
+ */
+uint8_t pmm_compact_background() {
+    for (int type = 0; type < MIGRATE_TYPES; type++) {
+        if (pmm.free_mask[type] & (1 << MAX_ORDER)) return 0;
+    }
+
+    if (pmm.free < 2u << MAX_BLOCK_LOG2) return 0;
 
-        // Get state of buddy of the parent block
-        buddy_address = ((address - pmm.base) ^ 1 << (order + MIN_BLOCK_LOG2)) + pmm.base;
-        buddy_state = get_state(buddy_address, order);
+    return compact(MAX_ORDER);
+}
+
+/**
+ * @brief Takes a page from the zeroed pools once the free lists are empty.
+ *
+ * The pool of @p migratetype is tried first, then the pools of its fallback
+ * types in the same order take_block steals from them.
+ *
+ * @param migratetype The mobility of the page (MIGRATE_TYPE).
+ * @return The physical address of the page, or 0 if every pool is empty.
+ */
+static phys_addr_t take_zeroed(uint8_t migratetype) {
+    if (pmm.zero_count[migratetype] > 0) return pmm.zero_pool[migratetype][--pmm.zero_count[migratetype]];
 
-        if (buddy_state != 0) break;
+    for (int i = 0; i < MIGRATE_TYPES - 1; i++) {
+        uint8_t type = fallbacks[migratetype][i];
+
+        if (pmm.zero_count[type] > 0) return pmm.zero_pool[type][--pmm.zero_count[type]];
     }
 
-    // Add the final, merged block back to free lists
-    free_list_append(address, order);
+    return 0;
+}
 
-    pmm.free += 1 << (order + MIN_BLOCK_LOG2);
+/**
+ * @brief Allocates a single zeroed page.
+ *
+ * A page is taken from the pool of @p migratetype kept filled by
+ * pmm_zero_idle, so the page lies in a pageblock of the requested mobility.
+ * The page is only cleared on the allocation path when that pool is empty.
+ *
+ * @param migratetype The mobility of the page (MIGRATE_TYPE).
+ * @return The physical address of the page, or 0 if allocation fails.
+ */
+phys_addr_t pmm_alloc_zeroed(uint8_t migratetype) {
+    if (pmm.zero_count[migratetype] > 0) return pmm.zero_pool[migratetype][--pmm.zero_count[migratetype]];
+
+    phys_addr_t address = pmm_malloc(PAGE_SIZE, migratetype);
+
+    if (address != 0) vmm_zero_page(address);
+
+    return address;
+}
+
+/**
+ * @brief Refills the pools of zeroed pages.
+ *
+ * This function is meant to be called while the kernel is idle. Pages are
+ * allocated and cleared until the unmovable and movable pools each hold
+ * ZERO_POOL_PAGES pages. Reclaimable memory is never allocated zeroed, so its
+ * pool is left empty. A page is only added to a pool once it is fully cleared.
+ */
+void pmm_zero_idle() {
+    static const uint8_t types[] = {MIGRATE_UNMOVABLE, MIGRATE_MOVABLE};
+
+    for (uint32_t i = 0; i < sizeof(types); i++) {
+        uint8_t type = types[i];
+
+        while (pmm.zero_count[type] < ZERO_POOL_PAGES) {
+            // pmm_malloc would hand back a page from the pools themselves
+            if (pmm.free == 0) return;
+
+            phys_addr_t address = pmm_malloc(PAGE_SIZE, type);
+
+            if (address == 0) return;
+
+            vmm_zero_page(address);
+
+            pmm.zero_pool[type][pmm.zero_count[type]++] = address;
+        }
+    }
 }
\ No newline at end of file
@@ -5,311 +5,2281 @@
 
 #include "stdio.h"
 
-static uint32_t get_current_pd();
-static uint32_t create_new_pt();
-static void split(vm_area_t *, uint32_t);
-static void merge(vm_area_t *);
-static void *get_vm_area(uint32_t);
+static page_directory_t *get_current_pd();
+static page_table_t *get_pt(uint32_t);
+static phys_addr_t create_new_pt();
+static void set_pde(uint32_t, pte_t);
+static uint8_t create_pts(uint32_t, uint32_t, uint32_t);
+static uint8_t account_pt(uint32_t, int32_t);
+static phys_addr_t unlink_pt(uint32_t);
+static uint32_t subtree_max_free(vm_area_t *);
+static void update_max_free(vm_area_t *);
+static void propagate(vm_area_t *);
+static void replace_child(mm_t *, vm_area_t *, vm_area_t *);
+static void rotate_left(mm_t *, vm_area_t *);
+static void rotate_right(mm_t *, vm_area_t *);
+static void insert_after(mm_t *, vm_area_t *, vm_area_t *);
+static void erase(mm_t *, vm_area_t *);
+static vm_area_t *find_area(mm_t *, uint32_t);
+static vm_area_t *find_free(mm_t *, uint32_t);
+static vm_area_t *alloc_node();
+static void refill_nodes();
+static void free_node(vm_area_t *);
+static void split(mm_t *, vm_area_t *, vm_area_t *, uint32_t);
+static void merge(mm_t *, vm_area_t *);
+static void *get_vm_area(mm_t *, uint32_t, uint32_t, uint8_t);
+static uint32_t check_tree(vm_area_t *, vm_area_t *);
+static uint8_t map_small(uint32_t, uint32_t, uint8_t);
+static uint8_t map_large(uint32_t, uint8_t);
+static uint8_t fault_in(uint32_t);
+static uint8_t cow_fault(uint32_t);
+static uint8_t put_page(phys_addr_t);
+static uint32_t share_pt(page_table_t *, phys_addr_t);
+static mm_t *mm_alloc();
+static phys_addr_t clear_pte(uint32_t, phys_addr_t *);
+static void flush_tlb_all();
+static void tlb_flush_gather();
+static void tlb_gather_page(uint32_t, phys_addr_t);
+static void tlb_gather_pt(phys_addr_t);
 
 page_directory_t boot_page_directory __attribute__((section(".page_tables")))__attribute__((aligned(PAGE_SIZE)));
-// Four page tables used for kernel mapping during boot
-page_table_t boot_page_tables[4] __attribute__((section(".page_tables")))__attribute__((aligned(PAGE_SIZE)));
+// Page table for temporary kernel mappings at KMAP_BASE
+page_table_t kmap_page_table __attribute__((section(".page_tables")))__attribute__((aligned(PAGE_SIZE)));
 
-// Kernel vm area linked list
-static vm_area_t *head = NULL;
+#ifdef CONFIG_PAE
+// Page directory pointer table loaded by boot.S, one entry per page directory
+uint64_t boot_pdpt[PD_PAGES] __attribute__((section(".page_tables")))__attribute__((aligned(32)));
+
+// CR3 only holds a 32-bit address, so the PDPTs of other address spaces are kept in the kernel image
+static uint64_t pdpts[MAX_ADDRESS_SPACES][PD_PAGES] __attribute__((aligned(32)));
+#endif
+
+// Number of pages allocated or freed together by one bulk PMM call
+#define BATCH_PAGES 64
+
+// Largest area of vmm_tree_benchmark, most of its areas are one or two pages
+#define BENCHMARK_MAX_PAGES 16
+
+// Buffer mapped by vmm_map_benchmark
+#define MAP_BENCHMARK_SIZE 0x400000
+
+// Largest span of the linear map walked by vmm_linear_benchmark
+#define LINEAR_BENCHMARK_SIZE 0x4000000
+
+// End of the physical memory linearly mapped at 0xC0000000
+static uint32_t linear_end = BOOT_MAP_END;
+
+// Time stamp counter cycles spent in vmm_map_linear at boot
+static uint32_t linear_map_cycles = 0;
+
+// Kernel address space, its vm areas cover the kernel half
+static mm_t kernel_mm = {
+    .pd = &boot_page_directory,
+#ifdef CONFIG_PAE
+    .pdpt = boot_pdpt,
+#endif
+};
+
+// Address space loaded in CR3
+static mm_t *current_mm = &kernel_mm;
+
+// All address spaces
+static mm_t *mm_list = &kernel_mm;
+
+// Page holding the vm area nodes created by vmm_init
+static uint32_t boot_nodes;
+
+// Cache of vm area nodes, created once the general purpose caches exist
+static cache_t *vm_area_cache = NULL;
+
+// Nodes set aside for growing vm_area_cache, which needs nodes itself
+#define NODE_RESERVE 8
+// Nodes one cache_grow can take, for a page of slab descriptors and the slab
+#define GROW_NODES 2
+static vm_area_t *node_reserve[NODE_RESERVE];
+static uint32_t reserve_count = 0;
+static uint8_t refilling = 0;
+
+// Pages unmapped by vmm_free
+static mmu_gather_t gather;
+
+// Page tables created by create_new_pt that are still in use
+static uint32_t pt_pages = 0;
+
+// 4 MiB pages mapped by vmm_malloc, and how often one could not be allocated
+static uint32_t large_pages = 0;
+static uint32_t large_fallbacks = 0;
+
+/**
+ * @brief Gets the current page directory.
+ *
+ * The last entry of every page directory maps the directory onto itself, so
+ * the current one is always found at PAGE_DIRECTORY.
+ *
+ * @return Pointer to the current page directory.
+ */
+static page_directory_t *get_current_pd() {
+    return (page_directory_t *)PAGE_DIRECTORY;
+}
+
+/**
+ * @brief Gets a virtual address through which a page table can be accessed.
+ *
+ * Through the recursive page directory entry, the page table installed in
+ * each page directory entry of the current address space appears at a fixed
+ * address starting at PAGE_TABLES, wherever it lies in physical memory.
+ *
+ * @param pde_index The page directory entry of the page table.
+ * @return Pointer to the page table.
+ */
+static page_table_t *get_pt(uint32_t pde_index) {
+    return (page_table_t *)(PAGE_TABLES + pde_index * PAGE_SIZE);
+}
+
+/**
+ * @brief Sets a page directory entry of the current address space.
+ *
+ * The kernel half is shared by all address spaces, so a kernel entry is
+ * written to every page directory. A kernel page table is then never missing
+ * from, or left behind in, another address space.
+ *
+ * @param pde_index The page directory entry to set.
+ * @param pde The new page directory entry.
+ */
+static void set_pde(uint32_t pde_index, pte_t pde) {
+    if (pde_index < KERNEL_PDE) {
+        get_current_pd()->entries[pde_index] = pde;
+        return;
+    }
+
+    for (mm_t *mm = mm_list; mm != NULL; mm = mm->next) {
+        mm->pd->entries[pde_index] = pde;
+    }
+}
+
+/**
+ * @brief Creates and initializes a new page table.
+ *
+ * This function allocates a zeroed 4 KiB page from physical memory to hold a
+ * new page table, so all of its entries are marked as not present. The page is
+ * usually taken from the pre-zeroed pool and not cleared here. Its frame
+ * descriptor counts the live entries, so the page table can be freed once the
+ * last of them is cleared.
+ *
+ * @return The physical address of the newly created page table, or 0 if no
+ *         physical memory is left.
+ */
+static phys_addr_t create_new_pt() {
+    phys_addr_t pt_addr = pmm_alloc_zeroed(MIGRATE_UNMOVABLE); // One page table fits in 4 KiB
+
+    if (pt_addr == 0) return 0;
+
+    page_t *page = pmm_get_page(pt_addr);
+
+    page->flags |= PG_PAGE_TABLE;
+    page->private = 0;
+
+    pt_pages++;
+
+    return pt_addr;
+}
+
+/**
+ * @brief Creates all missing page tables for a virtual memory range.
+ *
+ * This function finds the page directory entries covering @p virt_addr to
+ * @p virt_addr + @p length that have no page table, and installs a zeroed
+ * page table for each of them in the page directory. Page tables created
+ * before an allocation fails are kept.
+ *
+ * @param virt_addr The starting virtual address of the range.
+ * @param length The size of the range (in bytes).
+ * @param flags Page directory flags.
+ * @return 1 if the whole range has page tables, 0 if physical memory ran out.
+ */
+static uint8_t create_pts(uint32_t virt_addr, uint32_t length, uint32_t flags) {
+    page_directory_t *pd = get_current_pd();
+
+    uint32_t pde_index = PDE_INDEX(virt_addr);
+    uint32_t pde_end = PDE_INDEX(virt_addr + length - 1);
+
+    for (; pde_index <= pde_end; pde_index++) {
+        if (pd->entries[pde_index] & PDE_PRESENT) continue;
+
+        phys_addr_t pt_addr = create_new_pt();
+
+        if (pt_addr == 0) return 0;
+
+        set_pde(pde_index, pt_addr | flags);
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Adjusts the number of live entries of a page table.
+ *
+ * Only page tables made by create_new_pt are counted. The page tables of
+ * boot.S and the linear mapping are never freed.
+ *
+ * @param pde_index The page directory entry of the page table.
+ * @param delta The number of entries that were set (or cleared if negative).
+ * @return 1 if the page table is counted and has no live entries left, 0
+ *         otherwise.
+ */
+static uint8_t account_pt(uint32_t pde_index, int32_t delta) {
+    page_t *page = pmm_get_page(get_current_pd()->entries[pde_index] & PTE_ADDR);
+
+    if (!(page->flags & PG_PAGE_TABLE)) return 0;
+
+    page->private += delta;
+
+    return page->private == 0;
+}
+
+/**
+ * @brief Removes an empty page table from the page directory.
+ *
+ * The page directory entry is cleared and the page table's own translation in
+ * the recursive mapping is invalidated. The page table is not freed, that is
+ * left to the caller once no translation through it can remain in the TLB.
+ *
+ * @param pde_index The page directory entry of the page table.
+ * @return The physical address of the page table.
+ */
+static phys_addr_t unlink_pt(uint32_t pde_index) {
+    page_directory_t *pd = get_current_pd();
+
+    phys_addr_t pt_addr = pd->entries[pde_index] & PTE_ADDR;
+    set_pde(pde_index, 0);
+
+    __asm__ volatile("invlpg (%0)" : : "r"(get_pt(pde_index)) : "memory");
+
+    pt_pages--;
+
+    return pt_addr;
+}
+
+/**
+ * @brief Gets the size of the largest free area in a subtree.
+ *
+ * @param node The root of the subtree (may be NULL).
+ * @return The size of the largest free area, or 0 for an empty subtree.
+ */
+static uint32_t subtree_max_free(vm_area_t *node) {
+    return node != NULL ? node->max_free : 0;
+}
+
+/**
+ * @brief Recalculates the largest free area of a node's subtree.
+ *
+ * The children of @p node must already be up to date.
+ *
+ * @param node The node to update.
+ */
+static void update_max_free(vm_area_t *node) {
+    uint32_t max_free = node->used ? 0 : node->size;
+
+    if (subtree_max_free(node->left) > max_free) max_free = node->left->max_free;
+    if (subtree_max_free(node->right) > max_free) max_free = node->right->max_free;
+
+    node->max_free = max_free;
+}
+
+/**
+ * @brief Recalculates the largest free areas from a node up to the root.
+ *
+ * @param node The lowest node whose subtree changed (may be NULL).
+ */
+static void propagate(vm_area_t *node) {
+    while (node != NULL) {
+        update_max_free(node);
+
+        node = node->parent;
+    }
+}
+
+/**
+ * @brief Replaces a node in its parent, or as the root of the tree.
+ *
+ * @param mm The address space.
+ * @param old_node The node being replaced.
+ * @param new_node The node taking its place (may be NULL).
+ */
+static void replace_child(mm_t *mm, vm_area_t *old_node, vm_area_t *new_node) {
+    vm_area_t *parent = old_node->parent;
+
+    if (parent == NULL) mm->root = new_node;
+    else if (parent->left == old_node) parent->left = new_node;
+    else parent->right = new_node;
+}
+
+/**
+ * @brief Rotates a node down to the left.
+ *
+ * The right child of @p node takes its place. A rotation does not change
+ * which areas are in the subtree, so only the two rotated nodes need their
+ * largest free area recalculated.
+ *
+ * @param mm The address space.
+ * @param node The node to rotate.
+ */
+static void rotate_left(mm_t *mm, vm_area_t *node) {
+    vm_area_t *right = node->right;
+
+    node->right = right->left;
+    if (right->left != NULL) right->left->parent = node;
+
+    right->parent = node->parent;
+    replace_child(mm, node, right);
+
+    right->left = node;
+    node->parent = right;
+
+    update_max_free(node);
+    update_max_free(right);
+}
+
+/**
+ * @brief Rotates a node down to the right.
+ *
+ * The left child of @p node takes its place.
+ *
+ * @param mm The address space.
+ * @param node The node to rotate.
+ */
+static void rotate_right(mm_t *mm, vm_area_t *node) {
+    vm_area_t *left = node->left;
+
+    node->left = left->right;
+    if (left->right != NULL) left->right->parent = node;
+
+    left->parent = node->parent;
+    replace_child(mm, node, left);
+
+    left->right = node;
+    node->parent = left;
+
+    update_max_free(node);
+    update_max_free(left);
+}
+
+/**
+ * @brief Inserts an area into the tree directly after another area.
+ *
+ * Areas never overlap, so @p new_node is placed as the in-order successor of
+ * @p node and linked after it in the address ordered list. The tree is then
+ * rebalanced.
+ *
+ * @param mm The address space.
+ * @param node The area preceding the new area (NULL if the tree is empty).
+ * @param new_node The area to insert.
+ */
+static void insert_after(mm_t *mm, vm_area_t *node, vm_area_t *new_node) {
+    new_node->left = NULL;
+    new_node->right = NULL;
+    new_node->color = RB_RED;
+
+    if (node == NULL) {
+        new_node->parent = NULL;
+        new_node->prev = NULL;
+        new_node->next = NULL;
+
+        mm->root = new_node;
+    } else {
+        // The successor is the leftmost node of the right subtree
+        if (node->right == NULL) {
+            node->right = new_node;
+            new_node->parent = node;
+        } else {
+            vm_area_t *curr = node->right;
+
+            while (curr->left != NULL) curr = curr->left;
+
+            curr->left = new_node;
+            new_node->parent = curr;
+        }
+
+        new_node->prev = node;
+        new_node->next = node->next;
+
+        if (node->next != NULL) node->next->prev = new_node;
+        node->next = new_node;
+    }
+
+    propagate(new_node);
+
+    // Rebalance - a red node must not have a red parent
+    vm_area_t *curr = new_node;
+
+    while (curr->parent != NULL && curr->parent->color == RB_RED) {
+        vm_area_t *parent = curr->parent;
+        vm_area_t *grandparent = parent->parent;
+
+        if (parent == grandparent->left) {
+            vm_area_t *uncle = grandparent->right;
+
+            if (uncle != NULL && uncle->color == RB_RED) {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                grandparent->color = RB_RED;
+
+                curr = grandparent;
+                continue;
+            }
+
+            if (curr == parent->right) {
+                rotate_left(mm, parent);
+
+                curr = parent;
+                parent = curr->parent;
+            }
+
+            parent->color = RB_BLACK;
+            grandparent->color = RB_RED;
+            rotate_right(mm, grandparent);
+        } else {
+            vm_area_t *uncle = grandparent->left;
+
+            if (uncle != NULL && uncle->color == RB_RED) {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                grandparent->color = RB_RED;
+
+                curr = grandparent;
+                continue;
+            }
+
+            if (curr == parent->left) {
+                rotate_right(mm, parent);
+
+                curr = parent;
+                parent = curr->parent;
+            }
+
+            parent->color = RB_BLACK;
+            grandparent->color = RB_RED;
+            rotate_left(mm, grandparent);
+        }
+    }
+
+    mm->root->color = RB_BLACK;
+}
+
+/**
+ * @brief Removes an area from the tree.
+ *
+ * The area is unlinked from the address ordered list and removed from the
+ * tree. A node with two children is replaced by its in-order successor. If a
+ * black node was removed, the tree is rebalanced.
+ *
+ * @param mm The address space.
+ * @param node The area to remove.
+ */
+static void erase(mm_t *mm, vm_area_t *node) {
+    if (node->prev != NULL) node->prev->next = node->next;
+    if (node->next != NULL) node->next->prev = node->prev;
+
+    vm_area_t *child;
+    vm_area_t *parent;
+    uint8_t color;
+
+    if (node->left != NULL && node->right != NULL) {
+        vm_area_t *successor = node->right;
+
+        while (successor->left != NULL) successor = successor->left;
+
+        child = successor->right;
+        parent = successor->parent;
+        color = successor->color;
+
+        if (parent == node) {
+            parent = successor;
+        } else {
+            // Detach the successor and give it the right subtree of the node
+            parent->left = child;
+            if (child != NULL) child->parent = parent;
+
+            successor->right = node->right;
+            node->right->parent = successor;
+        }
+
+        successor->left = node->left;
+        node->left->parent = successor;
+
+        successor->parent = node->parent;
+        successor->color = node->color;
+        replace_child(mm, node, successor);
+    } else {
+        child = node->left != NULL ? node->left : node->right;
+        parent = node->parent;
+        color = node->color;
+
+        if (child != NULL) child->parent = parent;
+        replace_child(mm, node, child);
+    }
+
+    propagate(parent);
+
+    if (color == RB_RED) return;
+
+    // Rebalance - the path through child is one black node short
+    while (child != mm->root && (child == NULL || child->color == RB_BLACK)) {
+        if (child == parent->left) {
+            vm_area_t *sibling = parent->right;
+
+            if (sibling->color == RB_RED) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_left(mm, parent);
+
+                sibling = parent->right;
+            }
+
+            if ((sibling->left == NULL || sibling->left->color == RB_BLACK) && (sibling->right == NULL || sibling->right->color == RB_BLACK)) {
+                sibling->color = RB_RED;
+
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+
+            if (sibling->right == NULL || sibling->right->color == RB_BLACK) {
+                sibling->left->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rotate_right(mm, sibling);
+
+                sibling = parent->right;
+            }
+
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->right->color = RB_BLACK;
+            rotate_left(mm, parent);
+
+            child = mm->root;
+        } else {
+            vm_area_t *sibling = parent->left;
+
+            if (sibling->color == RB_RED) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_right(mm, parent);
+
+                sibling = parent->left;
+            }
+
+            if ((sibling->left == NULL || sibling->left->color == RB_BLACK) && (sibling->right == NULL || sibling->right->color == RB_BLACK)) {
+                sibling->color = RB_RED;
+
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+
+            if (sibling->left == NULL || sibling->left->color == RB_BLACK) {
+                sibling->right->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rotate_left(mm, sibling);
+
+                sibling = parent->left;
+            }
+
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->left->color = RB_BLACK;
+            rotate_right(mm, parent);
+
+            child = mm->root;
+        }
+    }
+
+    if (child != NULL) child->color = RB_BLACK;
+}
+
+/**
+ * @brief Finds the area containing an address.
+ *
+ * @param mm The address space.
+ * @param addr A virtual address.
+ * @return Pointer to the area, or NULL if no area contains @p addr.
+ */
+static vm_area_t *find_area(mm_t *mm, uint32_t addr) {
+    vm_area_t *node = mm->root;
+    vm_area_t *found = NULL;
+
+    // Find the last area starting at or below the address
+    while (node != NULL) {
+        if (addr < node->addr) {
+            node = node->left;
+        } else {
+            found = node;
+            node = node->right;
+        }
+    }
+
+    if (found == NULL || addr - found->addr >= found->size) return NULL;
+
+    return found;
+}
+
+/**
+ * @brief Finds the lowest free area that can hold a length.
+ *
+ * Subtrees whose largest free area is too small are skipped, so the search
+ * follows a single path from the root.
+ *
+ * @param mm The address space.
+ * @param length The size needed (in bytes).
+ * @return Pointer to the free area, or NULL if no free area is large enough.
+ */
+static vm_area_t *find_free(mm_t *mm, uint32_t length) {
+    vm_area_t *node = mm->root;
+
+    if (subtree_max_free(node) < length) return NULL;
+
+    while (node != NULL) {
+        if (subtree_max_free(node->left) >= length) node = node->left;
+        else if (!node->used && node->size >= length) return node;
+        else node = node->right;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Allocates a vm_area_t node.
+ *
+ * Nodes needed while the slab allocator initializes come from kmalloc, all
+ * later ones from the vm area cache through the node reserve. Growing the
+ * cache reserves virtual memory, which takes nodes of its own, so while
+ * refill_nodes grows the cache those nodes come straight from the reserve
+ * instead of from the cache. GROW_NODES nodes are always kept back for that.
+ *
+ * @return Pointer to the node, or NULL if allocation fails.
+ */
+static vm_area_t *alloc_node() {
+    if (vm_area_cache == NULL) return kmalloc(sizeof(vm_area_t));
+
+    // Called while the cache grows - never grow it again from here
+    if (refilling) return reserve_count > 0 ? node_reserve[--reserve_count] : NULL;
+
+    refill_nodes();
+
+    if (reserve_count <= GROW_NODES) return NULL;
+
+    return node_reserve[--reserve_count];
+}
+
+/**
+ * @brief Tops up the node reserve from the vm area cache.
+ *
+ * The cache may grow on the way, taking at most GROW_NODES nodes from the
+ * reserve, and the reserve is filled again from the new slab. If memory runs
+ * out, the reserve is left as full as it could be made.
+ */
+static void refill_nodes() {
+    refilling = 1;
+
+    while (reserve_count < NODE_RESERVE) {
+        vm_area_t *node = kmem_cache_alloc(vm_area_cache);
+
+        if (node == NULL) break;
+
+        node_reserve[reserve_count++] = node;
+    }
+
+    refilling = 0;
+}
+
+/**
+ * @brief Frees the memory of a vm_area_t node.
+ *
+ * Nodes created by vmm_init live in a page of their own and are not returned
+ * to the kernel heap. kfree returns all others to the cache they came from.
+ *
+ * @param node The node to free.
+ */
+static void free_node(vm_area_t *node) {
+    if ((uint32_t)node - boot_nodes < PAGE_SIZE) return;
+
+    kfree(node);
+}
+
+/**
+ * @brief Splits a free virtual memory area into two separate areas.
+ *
+ * The original area is resized to @p length, and @p split_node is sized to
+ * the remainder of the original size and inserted into the tree directly
+ * after it.
+ *
+ * @param mm The address space.
+ * @param node Pointer to the vm_area_t node to be split.
+ * @param split_node The node for the remainder.
+ * @param length The size of the node to be split off (in bytes).
+ */
+static void split(mm_t *mm, vm_area_t *node, vm_area_t *split_node, uint32_t length) {
+    split_node->addr = node->addr + length;
+    split_node->size = node->size - length;
+    split_node->used = 0;
+
+    node->size = length;
+
+    update_max_free(node);
+    insert_after(mm, node, split_node);
+}
+
+/**
+ * @brief Merges a free virtual memory area with its free neighbours.
+ *
+ * The areas directly before and after @p node in address order are joined
+ * with it if they are free, so free space never stays fragmented into
+ * neighbouring areas. The leftover nodes are freed once the tree is
+ * consistent again, since kfree may itself free virtual memory.
+ *
+ * @param mm The address space.
+ * @param node Pointer to the free vm_area_t node to merge.
+ */
+static void merge(mm_t *mm, vm_area_t *node) {
+    vm_area_t *next = node->next;
+    vm_area_t *prev = node->prev;
+
+    if (next != NULL && next->used == 0) {
+        node->size += next->size;
+        erase(mm, next);
+    } else {
+        next = NULL;
+    }
+
+    if (prev != NULL && prev->used == 0) {
+        prev->size += node->size;
+        erase(mm, node);
+
+        vm_area_t *merged = node;
+        node = prev;
+        prev = merged;
+    } else {
+        prev = NULL;
+    }
+
+    propagate(node);
+
+    if (next != NULL) free_node(next);
+    if (prev != NULL) free_node(prev);
+}
+
+/**
+ * @brief Finds and allocates a virtual memory area of the requested size.
+ *
+ * This function searches the tree of virtual memory areas for the lowest
+ * unused area that can accommodate the requested length at the requested
+ * alignment. Any free area of @p length + @p align - PAGE_SIZE bytes holds
+ * an aligned range, so that is the size searched for. The unaligned head of
+ * the found area is split off and stays free, and the rest is split to match
+ * the exact size needed. The found area is marked as used and its address is
+ * returned. If a node needed for a split cannot be allocated, the tree is
+ * left unchanged and the allocation fails.
+ *
+ * @param mm The address space.
+ * @param length The size of the virtual memory area needed (in bytes).
+ * @param align The alignment of the area, a power of 2 of at least PAGE_SIZE.
+ * @param flags VM_AREA_FLAGS of the area.
+ * @return Pointer to the starting address of the allocated virtual memory area,
+ *         or NULL if no suitable area is found.
+ */
+static void *get_vm_area(mm_t *mm, uint32_t length, uint32_t align, uint8_t flags) {
+    uint32_t search_length = length + align - PAGE_SIZE;
+
+    vm_area_t *node = find_free(mm, search_length);
+
+    if (node == NULL) return NULL;
+
+    // Split if a larger than needed node is found
+    if (node->size > length) {
+        vm_area_t *aligned_node = align > PAGE_SIZE ? alloc_node() : NULL;
+        vm_area_t *split_node = alloc_node();
+
+        // Allocating nodes may have allocated virtual memory itself - search again
+        node = find_free(mm, search_length);
+
+        uint32_t addr = node != NULL ? (node->addr + align - 1) & ~(align - 1) : 0;
+
+        // Out of memory for tree nodes - fail before the tree is changed
+        if (node != NULL && addr > node->addr && aligned_node == NULL) node = NULL;
+        if (node != NULL && node->addr + node->size - addr > length && split_node == NULL) node = NULL;
+
+        if (node != NULL) {
+            if (addr > node->addr) {
+                split(mm, node, aligned_node, addr - node->addr);
+
+                node = aligned_node;
+                aligned_node = NULL;
+            }
+
+            if (node->size > length) {
+                split(mm, node, split_node, length);
+
+                split_node = NULL;
+            }
+        }
+
+        if (aligned_node != NULL) free_node(aligned_node);
+        if (split_node != NULL) free_node(split_node);
+
+        if (node == NULL) return NULL;
+    }
+
+    node->used = 1;
+    node->flags = flags;
+    propagate(node);
+
+    return (uint32_t *)node->addr;
+}
+
+/**
+ * @brief Initializes the virtual memory manager.
+ *
+ * This function sets up the virtual memory managemer by installing the page
+ * table for temporary kernel mappings and creating the initial tree of
+ * vm_area_t nodes. The ten nodes live in a page mapped at @p virt_addr_base.
+ * The first nine cover 4 KiB each and are used to initialize the slab
+ * allocator, the tenth covers the remaining virtual address space up to
+ * KMAP_BASE. All nodes are initially marked as unused. Finally, since the
+ * kernel no longer needs physical addresses to be mapped, the identity
+ * mapping made by boot.S is removed.
+ *
+ * @param virt_addr_base The starting virtual address for the managed memory
+ *        region.
+ */
+void vmm_init(uint32_t virt_addr_base) {
+    page_directory_t *pd = get_current_pd();
+
+#ifdef CONFIG_PAE
+    kernel_mm.cr3 = (uint32_t)boot_pdpt - 0xC0000000;
+#else
+    kernel_mm.cr3 = (uint32_t)&boot_page_directory - 0xC0000000;
+#endif
+
+    uint32_t kmap_pt_addr = (uint32_t)&kmap_page_table - 0xC0000000;
+    pd->entries[PDE_INDEX(KMAP_BASE)] = kmap_pt_addr | PDE_PRESENT | PDE_READ_WRITE;
+
+    // Allocate and map a page for inital tree nodes
+    phys_addr_t phys_addr = pmm_malloc(PAGE_SIZE, MIGRATE_UNMOVABLE);
+    vmm_map(virt_addr_base, phys_addr, 0x3);
+
+    vm_area_t *nodes = (vm_area_t *)virt_addr_base;
+    boot_nodes = virt_addr_base;
+    virt_addr_base += PAGE_SIZE;
+
+    // Pre-split 10 4 KiB nodes - the first 9 will be used to initialize the slab allocator
+    for (int i = 0; i < 10; i++) {
+        nodes[i].addr = virt_addr_base;
+        nodes[i].size = PAGE_SIZE;
+        nodes[i].used = 0;
+
+        virt_addr_base += PAGE_SIZE;
+
+        insert_after(&kernel_mm, i > 0 ? &nodes[i - 1] : NULL, &nodes[i]);
+    }
+
+    // The tenth node covers the rest of the virtual memory area
+    nodes[9].size = KMAP_BASE - nodes[9].addr;
+    propagate(&nodes[9]);
+
+    // Drop the identity mapping made by boot.S - it is not global, so reloading CR3 flushes it
+    for (uint32_t i = 0; i < PDE_INDEX(BOOT_MAP_END); i++) {
+        pd->entries[i] = 0;
+    }
+
+    __asm__ volatile("mov %%cr3, %%eax; mov %%eax, %%cr3" : : : "eax", "memory");
+}
+
+/**
+ * @brief Creates the cache of vm_area_t nodes.
+ *
+ * Called by kmem_init once the general purpose caches exist. The cache
+ * bypasses the magazine layer, since magazines are allocated while the heap
+ * grows, which itself needs nodes. The node reserve is filled before the
+ * cache is used, while nodes for growing it still come from kmalloc.
+ */
+void vmm_cache_init() {
+    cache_t *cache = kmem_cache_create("vm_area_t", sizeof(vm_area_t), 0, NULL, NULL);
+    cache->flags &= ~CACHE_MAGAZINES;
+
+    while (reserve_count < NODE_RESERVE) {
+        vm_area_t *node = kmem_cache_alloc(cache);
+
+        if (node == NULL) break;
+
+        node_reserve[reserve_count++] = node;
+    }
+
+    vm_area_cache = cache;
+}
+
+/**
+ * @brief Extends the linear mapping of physical memory at 0xC0000000.
+ *
+ * boot.S maps the first BOOT_MAP_END bytes of physical memory. This function
+ * maps the rest of physical memory up to @p phys_end with read/write
+ * permissions as global pages. Every whole large page of memory is mapped
+ * with a single page directory entry, only a partial one at the end needs a
+ * page table, which is taken from @p pt_pool and filled in through the
+ * recursive mapping.
+ *
+ * @param phys_end The end of the physical memory to map.
+ * @param pt_pool The physical address of the page table to use.
+ */
+void vmm_map_linear(uint32_t phys_end, uint32_t pt_pool) {
+    uint64_t start;
+    __asm__ volatile("rdtsc" : "=A"(start));
+
+    page_directory_t *pd = get_current_pd();
+
+    for (uint32_t addr = BOOT_MAP_END; addr < phys_end; addr += LARGE_PAGE_SIZE) {
+        if (phys_end - addr >= LARGE_PAGE_SIZE) {
+            pd->entries[PDE_INDEX(addr + 0xC0000000)] = addr | PDE_GLOBAL | PDE_PAGE_SIZE | PDE_PRESENT | PDE_READ_WRITE;
+            continue;
+        }
+
+        uint32_t pde_index = PDE_INDEX(addr + 0xC0000000);
+
+        pd->entries[pde_index] = pt_pool | PDE_PRESENT | PDE_READ_WRITE;
+
+        page_table_t *pt = get_pt(pde_index);
+
+        for (uint32_t i = 0; i < PT_ENTRIES; i++) {
+            uint32_t phys_addr = addr + i * PAGE_SIZE;
+
+            pt->entries[i] = phys_addr < phys_end ? phys_addr | PTE_GLOBAL | PTE_PRESENT | PTE_READ_WRITE : 0;
+        }
+
+        pt_pool += PAGE_SIZE;
+    }
+
+    if (phys_end > linear_end) linear_end = phys_end;
+
+    uint64_t end;
+    __asm__ volatile("rdtsc" : "=A"(end));
+
+    linear_map_cycles += (uint32_t)(end - start);
+}
+
+/**
+ * @brief Temporarily maps a physical page into kernel virtual memory.
+ *
+ * Each slot is a single page at KMAP_BASE. Mapping a slot replaces its previous
+ * mapping, and the old translation is invalidated.
+ *
+ * @param phys_addr The physical address of the page to map.
+ * @param slot The temporary mapping slot to use.
+ * @return The virtual address the page is mapped at.
+ */
+void *vmm_kmap(phys_addr_t phys_addr, uint32_t slot) {
+    uint32_t virt_addr = KMAP_BASE + slot * PAGE_SIZE;
+
+    kmap_page_table.entries[slot] = (phys_addr & PTE_ADDR) | PTE_GLOBAL | PTE_PRESENT | PTE_READ_WRITE;
+
+    __asm__ volatile("invlpg (%0)" : : "r"(virt_addr) : "memory");
+
+    return (void *)virt_addr;
+}
+
+/**
+ * @brief Removes a temporary kernel mapping.
+ *
+ * @param slot The temporary mapping slot to clear.
+ */
+void vmm_kunmap(uint32_t slot) {
+    uint32_t virt_addr = KMAP_BASE + slot * PAGE_SIZE;
+
+    kmap_page_table.entries[slot] = 0;
+
+    __asm__ volatile("invlpg (%0)" : : "r"(virt_addr) : "memory");
+}
+
+/**
+ * @brief Maps a virtual address to a physical address in the page tables.
+ *
+ * This function establishes a mapping between @p virt_addr and @p phys_addr by
+ * updating the appropriate page directory and page table entries. If the
+ * required page table does not exist, it is created automatically. The function
+ * does not overwrite existing mappings if the page is already present. Kernel
+ * mappings in the higher half are global, so they stay in the TLB across
+ * address space switches.
+ *
+ * @param virt_addr The virtual address to be mapped.
+ * @param phys_addr The physical address to map to.
+ * @param flags Page table flags.
+ * @return 1 if the page is mapped, 0 if its page table could not be allocated.
+ */
+uint8_t vmm_map(uint32_t virt_addr, phys_addr_t phys_addr, uint32_t flags) {
+    uint32_t pde_index = PDE_INDEX(virt_addr);
+    uint32_t pte_index = PTE_INDEX(virt_addr);
+
+    page_directory_t *pd = get_current_pd();
+
+    // Check if page table exists
+    if (!(pd->entries[pde_index] & PDE_PRESENT)) {
+        phys_addr_t pt_addr = create_new_pt();
+
+        if (pt_addr == 0) return 0;
+
+        set_pde(pde_index, pt_addr | flags);
+    }
+
+    // Address is already mapped by a 4 MiB page
+    if (pd->entries[pde_index] & PDE_PAGE_SIZE) return 1;
+    
+    page_table_t *pt = get_pt(pde_index);
+    
+    if (virt_addr >= 0xC0000000) flags |= PTE_GLOBAL;
+
+    // Check if address is already mapped
+    if (!(pt->entries[pte_index] & PTE_PRESENT)) {
+        pt->entries[pte_index] = phys_addr | flags;
+
+        account_pt(pde_index, 1);
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Maps a range of virtual pages to physical pages.
+ *
+ * This function maps @p count pages starting at @p virt_addr, either to the
+ * physically contiguous memory starting at @p phys_addr or, if @p frames is
+ * not NULL, to the pages listed in @p frames. All missing page tables are
+ * created first, then each page table is looked up once and its entries are
+ * filled in a single run. Like vmm_map, present entries and ranges covered by
+ * 4 MiB pages are left alone, and kernel mappings are global.
+ *
+ * @param virt_addr The page aligned starting virtual address.
+ * @param phys_addr The starting physical address, ignored if @p frames is set.
+ * @param frames The physical pages to map, or NULL.
+ * @param count The number of pages to map.
+ * @param flags Page table flags.
+ * @return 1 if the range was mapped, 0 if a page table could not be allocated
+ *         (nothing is mapped then).
+ */
+uint8_t vmm_map_range(uint32_t virt_addr, phys_addr_t phys_addr, const phys_addr_t *frames, uint32_t count, uint32_t flags) {
+    if (count == 0) return 1;
+
+    if (!create_pts(virt_addr, count * PAGE_SIZE, flags)) return 0;
+
+    page_directory_t *pd = get_current_pd();
+
+    if (virt_addr >= 0xC0000000) flags |= PTE_GLOBAL;
+
+    while (count > 0) {
+        uint32_t pde_index = PDE_INDEX(virt_addr);
+        uint32_t pte_index = PTE_INDEX(virt_addr);
+
+        // Pages left in this page table
+        uint32_t run = PT_ENTRIES - pte_index;
+        if (run > count) run = count;
+
+        if (!(pd->entries[pde_index] & PDE_PAGE_SIZE)) {
+            pte_t *pte = &get_pt(pde_index)->entries[pte_index];
+            uint32_t mapped = 0;
+
+            if (frames != NULL) {
+                for (uint32_t i = 0; i < run; i++) {
+                    if (pte[i] & PTE_PRESENT) continue;
+
+                    pte[i] = frames[i] | flags;
+                    mapped++;
+                }
+            } else {
+                for (uint32_t i = 0; i < run; i++) {
+                    if (pte[i] & PTE_PRESENT) continue;
+
+                    pte[i] = (phys_addr + i * PAGE_SIZE) | flags;
+                    mapped++;
+                }
+            }
+
+            account_pt(pde_index, mapped);
+        }
+
+        if (frames != NULL) frames += run;
+        else phys_addr += run * PAGE_SIZE;
+
+        virt_addr += run * PAGE_SIZE;
+        count -= run;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Clears the page table entry of a virtual address.
+ *
+ * The TLB is not flushed, that is left to the caller. If this empties the
+ * page table, it is unlinked and its address stored in @p empty_pt for the
+ * caller to free after the flush.
+ *
+ * @param virt_addr The virtual address to be unmapped.
+ * @param empty_pt Set to the physical address of the unlinked page table, or
+ *        0 if the page table is still in use.
+ * @return The physical address that was previously mapped to the virtual
+ *         address, or 0 if no page table covers the address.
+ */
+static phys_addr_t clear_pte(uint32_t virt_addr, phys_addr_t *empty_pt) {
+    uint32_t pde_index = PDE_INDEX(virt_addr);
+    uint32_t pte_index = PTE_INDEX(virt_addr);
+
+    page_directory_t *pd = get_current_pd();
+    pte_t pde = pd->entries[pde_index];
+
+    *empty_pt = 0;
+
+    // 4 MiB pages are only unmapped whole, by vmm_unmap_range
+    if (!(pde & PDE_PRESENT) || pde & PDE_PAGE_SIZE) return 0;
+
+    page_table_t *pt = get_pt(pde_index);
+    pte_t pte = pt->entries[pte_index];
+
+    if (!(pte & PTE_PRESENT)) return pte & PTE_ADDR;
+
+    pt->entries[pte_index] = 0;
+
+    if (account_pt(pde_index, -1)) *empty_pt = unlink_pt(pde_index);
+
+    return pte & PTE_ADDR;
+}
+
+/**
+ * @brief Flushes the whole TLB, including global entries.
+ *
+ * Reloading CR3 keeps global entries, so CR4.PGE is toggled instead.
+ */
+static void flush_tlb_all() {
+    uint32_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4 & ~CR4_PGE) : "memory");
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+/**
+ * @brief Flushes the TLB for the gathered range and frees its frames.
+ *
+ * Small ranges are flushed page by page with invlpg. A range of more than
+ * TLB_FLUSH_THRESHOLD pages is cheaper to drop with one full flush. The frames
+ * are only freed after the flush, so no stale translation can reach a frame
+ * that has been handed out again.
+ */
+static void tlb_flush_gather() {
+    uint32_t pages = (gather.end - gather.start) / PAGE_SIZE;
+
+    if (pages > TLB_FLUSH_THRESHOLD) {
+        flush_tlb_all();
+    } else {
+        for (uint32_t addr = gather.start; addr < gather.end; addr += PAGE_SIZE) {
+            __asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
+        }
+    }
+
+    if (gather.count > 0) pmm_free_bulk(gather.count, gather.frames);
+
+    gather.start = gather.end;
+    gather.count = 0;
+}
+
+/**
+ * @brief Records an unmapped page in the gather.
+ *
+ * Pages are unmapped in ascending order, so the gathered range only grows at
+ * its end. When the gather holds GATHER_PAGES frames it is flushed.
+ *
+ * @param virt_addr The virtual address that was unmapped.
+ * @param phys_addr The physical page that was mapped there, or 0 if it is not
+ *        to be freed.
+ */
+static void tlb_gather_page(uint32_t virt_addr, phys_addr_t phys_addr) {
+    if (gather.start == gather.end) gather.start = virt_addr;
+
+    gather.end = virt_addr + PAGE_SIZE;
+
+    if (phys_addr == 0) return;
+
+    gather.frames[gather.count++] = phys_addr;
+
+    if (gather.count == GATHER_PAGES) tlb_flush_gather();
+}
+
+/**
+ * @brief Records an empty page table in the gather.
+ *
+ * The page table is freed together with the gathered pages, after the TLB
+ * flush drops every translation that went through it.
+ *
+ * @param pt_addr The physical address of the unlinked page table.
+ */
+static void tlb_gather_pt(phys_addr_t pt_addr) {
+    gather.frames[gather.count++] = pt_addr;
+
+    if (gather.count == GATHER_PAGES) tlb_flush_gather();
+}
+
+/**
+ * @brief Unmaps a virtual address and returns its physical address.
+ *
+ * This function removes the mapping for @p virt_addr by clearing the
+ * corresponding page table entry and invalidating its TLB entry. The physical
+ * address mapped to @p virt_addr is extracted and returned before the entry
+ * is cleared. A page table left empty is freed.
+ *
+ * @param virt_addr The virtual address to be unmapped.
+ * @return The physical address that was previously mapped to the virtual
+ *         address, or 0 if no page table covers the address.
+ */
+phys_addr_t vmm_unmap(uint32_t virt_addr) {
+    phys_addr_t pt_addr;
+    phys_addr_t phys_addr = clear_pte(virt_addr, &pt_addr);
+
+    __asm__ volatile("invlpg (%0)" : : "r"(virt_addr & PTE_FRAME) : "memory");
+
+    if (pt_addr != 0) pmm_free(pt_addr);
+
+    return phys_addr;
+}
+
+/**
+ * @brief Unmaps a range of virtual pages.
+ *
+ * Each page table covering the range is looked up once and its entries are
+ * cleared in a single run. Pages that are not mapped are skipped. A 4 MiB page
+ * mapped by vmm_malloc is unmapped and flushed on its own if the range covers
+ * all of it, other 4 MiB pages are skipped. The unmapped range is gathered
+ * and the TLB is flushed once per batch of up to GATHER_PAGES pages. If
+ * @p free_frames is set, the physical pages are freed with pmm_free_bulk
+ * after the flush, so physically contiguous pages go back as whole buddies. A
+ * page shared by mm_clone is only freed by the last address space mapping it.
+ * Page tables left empty are unlinked and always freed after the flush.
+ *
+ * @param virt_addr The page aligned starting virtual address.
+ * @param count The number of pages to unmap.
+ * @param free_frames 1 to free the physical pages, 0 to keep them.
+ */
+void vmm_unmap_range(uint32_t virt_addr, uint32_t count, uint8_t free_frames) {
+    page_directory_t *pd = get_current_pd();
+
+    while (count > 0) {
+        uint32_t pde_index = PDE_INDEX(virt_addr);
+        uint32_t pte_index = PTE_INDEX(virt_addr);
+
+        // Pages left in this page table
+        uint32_t run = PT_ENTRIES - pte_index;
+        if (run > count) run = count;
+
+        pte_t pde = pd->entries[pde_index];
+
+        // A large page of vmm_malloc goes as a whole, those of the linear mapping are never unmapped
+        if (pde & PDE_PAGE_SIZE) {
+            if (pde & PDE_ALLOCATED && run == PT_ENTRIES) {
+                set_pde(pde_index, 0);
+
+                __asm__ volatile("invlpg (%0)" : : "r"(virt_addr) : "memory");
+
+                if (free_frames) pmm_free(pde & PTE_ADDR);
+
+                large_pages--;
+            }
+        } else if (pde & PDE_PRESENT) {
+            pte_t *pte = &get_pt(pde_index)->entries[pte_index];
+            uint32_t cleared = 0;
+
+            for (uint32_t i = 0; i < run; i++) {
+                if (!(pte[i] & PTE_PRESENT)) continue;
+
+                phys_addr_t phys_addr = pte[i] & PTE_ADDR;
+                pte[i] = 0;
+                cleared++;
+
+                tlb_gather_page(virt_addr + i * PAGE_SIZE, free_frames && put_page(phys_addr) ? phys_addr : 0);
+            }
+
+            if (cleared > 0 && account_pt(pde_index, -cleared)) tlb_gather_pt(unlink_pt(pde_index));
+        }
+
+        virt_addr += run * PAGE_SIZE;
+        count -= run;
+    }
+
+    if (gather.start != gather.end || gather.count > 0) tlb_flush_gather();
+}
+
+/**
+ * @brief Translates a virtual address to its physical address.
+ *
+ * @param virt_addr The virtual address to translate.
+ * @return The physical address mapped to @p virt_addr, or 0 if it is not
+ *         mapped.
+ */
+phys_addr_t vmm_get_phys(uint32_t virt_addr) {
+    uint32_t pde_index = PDE_INDEX(virt_addr);
+    uint32_t pte_index = PTE_INDEX(virt_addr);
+
+    page_directory_t *pd = get_current_pd();
+    pte_t pde = pd->entries[pde_index];
+
+    if (!(pde & PDE_PRESENT)) return 0;
+
+    if (pde & PDE_PAGE_SIZE) return (pde & PTE_ADDR & ~(phys_addr_t)(LARGE_PAGE_SIZE - 1)) | (virt_addr & (LARGE_PAGE_SIZE - 1));
+
+    page_table_t *pt = get_pt(pde_index);
+    pte_t pte = pt->entries[pte_index];
+
+    if (!(pte & PTE_PRESENT)) return 0;
+
+    return (pte & PTE_ADDR) | (virt_addr & (PAGE_SIZE - 1));
+}
+
+/**
+ * @brief Moves a mapped page to a new physical page.
+ *
+ * The contents of the page mapped at @p virt_addr are copied to @p phys_addr
+ * through the KMAP_MIGRATE slot. The page table entry is then pointed at the
+ * new page with its flags kept, and the old translation is invalidated. The
+ * old physical page is left to the caller to free.
+ *
+ * @param virt_addr The virtual address of the page to move.
+ * @param phys_addr The physical address of the page to move it to.
+ */
+void vmm_migrate_page(uint32_t virt_addr, phys_addr_t phys_addr) {
+    uint32_t pde_index = PDE_INDEX(virt_addr);
+    uint32_t pte_index = PTE_INDEX(virt_addr);
+
+    uint32_t *src = (uint32_t *)(virt_addr & PTE_FRAME);
+    uint32_t *dst = vmm_kmap(phys_addr, KMAP_MIGRATE);
+
+    for (int i = 0; i < 1024; i++) {
+        dst[i] = src[i];
+    }
+
+    vmm_kunmap(KMAP_MIGRATE);
+
+    page_table_t *pt = get_pt(pde_index);
+
+    pt->entries[pte_index] = (phys_addr & PTE_ADDR) | (pt->entries[pte_index] & ~PTE_ADDR);
+
+    __asm__ volatile("invlpg (%0)" : : "r"(virt_addr & PTE_FRAME) : "memory");
+}
+
+/**
+ * @brief Fills a physical page with zeroes.
+ *
+ * Pages in linearly mapped physical memory are cleared through the linear
+ * mapping, pages above it through the KMAP_ZERO slot.
+ *
+ * @param phys_addr The physical address of the page.
+ */
+void vmm_zero_page(phys_addr_t phys_addr) {
+    uint32_t *page;
+
+    if (phys_addr < linear_end) page = (uint32_t *)((uint32_t)phys_addr + 0xC0000000);
+    else page = vmm_kmap(phys_addr, KMAP_ZERO);
+
+    for (int i = 0; i < 1024; i++) {
+        page[i] = 0;
+    }
+
+    if (phys_addr >= linear_end) vmm_kunmap(KMAP_ZERO);
+}
+
+/**
+ * @brief Maps a zeroed page for a demand paged address.
+ *
+ * A kernel page is movable, so its frame descriptor records where it is
+ * mapped. A user page may later be shared by several address spaces, which
+ * the frame descriptor cannot record, so it is not migrated.
+ *
+ * @param virt_addr The page aligned virtual address to back.
+ * @return 1 if the page was mapped, 0 if no physical memory is left for the
+ *         page or its page table.
+ */
+static uint8_t fault_in(uint32_t virt_addr) {
+    if (virt_addr < 0xC0000000) {
+        phys_addr_t phys_addr = pmm_alloc_zeroed(MIGRATE_UNMOVABLE);
+
+        if (phys_addr == 0) return 0;
+
+        if (!vmm_map(virt_addr, phys_addr, 0x7)) {
+            pmm_free(phys_addr);
+
+            return 0;
+        }
+
+        return 1;
+    }
+
+    phys_addr_t phys_addr = pmm_alloc_zeroed(MIGRATE_MOVABLE);
+
+    if (phys_addr == 0) return 0;
+
+    if (!vmm_map(virt_addr, phys_addr, 0x3)) {
+        pmm_free(phys_addr);
+
+        return 0;
+    }
+
+    page_t *page = pmm_get_page(phys_addr);
+
+    page->flags |= PG_MOVABLE;
+    page->mapping = virt_addr;
+
+    return 1;
+}
+
+/**
+ * @brief Resolves a write to a copy-on-write page.
+ *
+ * While other address spaces still share the page, it is copied to a new
+ * page through the KMAP_COPY slot and the shared page loses a reference. The
+ * last address space left takes the page over without copying. Either way the
+ * page is mapped writable again.
+ *
+ * @param virt_addr The faulting virtual address.
+ * @return 1 if the fault was resolved, 0 if the page is not copy-on-write or
+ *         no physical memory is left.
+ */
+static uint8_t cow_fault(uint32_t virt_addr) {
+    uint32_t pde_index = PDE_INDEX(virt_addr);
+    uint32_t pte_index = PTE_INDEX(virt_addr);
+
+    pte_t pde = get_current_pd()->entries[pde_index];
+
+    if (!(pde & PDE_PRESENT) || pde & PDE_PAGE_SIZE) return 0;
+
+    page_table_t *pt = get_pt(pde_index);
+    pte_t pte = pt->entries[pte_index];
+
+    if (!(pte & PTE_PRESENT) || !(pte & PTE_COW)) return 0;
+
+    uint32_t virt_page = virt_addr & PTE_FRAME;
+    phys_addr_t phys_addr = pte & PTE_ADDR;
+
+    page_t *page = pmm_get_page(phys_addr);
+
+    if (page->refcount > 1) {
+        phys_addr_t copy_addr = pmm_malloc(PAGE_SIZE, MIGRATE_UNMOVABLE);
+
+        if (copy_addr == 0) return 0;
+
+        uint32_t *src = (uint32_t *)virt_page;
+        uint32_t *dst = vmm_kmap(copy_addr, KMAP_COPY);
+
+        for (int i = 0; i < 1024; i++) {
+            dst[i] = src[i];
+        }
+
+        vmm_kunmap(KMAP_COPY);
+
+        page->refcount--;
+        phys_addr = copy_addr;
+    }
+
+    pt->entries[pte_index] = phys_addr | (pte & ~(PTE_ADDR | PTE_COW)) | PTE_READ_WRITE;
+
+    __asm__ volatile("invlpg (%0)" : : "r"(virt_page) : "memory");
+
+    return 1;
+}
+
+/**
+ * @brief Handles a page fault on demand paged or copy-on-write memory.
+ *
+ * A write to a present copy-on-write page is resolved by cow_fault. A fault on
+ * a page that is not present inside a used VMA_DEMAND_PAGED area
+ * is resolved by mapping a zeroed page. The other missing pages of the
+ * aligned FAULT_AROUND_PAGES window around the fault are mapped as well, so
+ * sequential access does not trap on every page. Pages of the window outside
+ * the area are left alone. Kernel addresses are looked up in the kernel vm
+ * areas, user addresses in those of the current address space.
+ *
+ * @param virt_addr The faulting virtual address (CR2).
+ * @param error The page fault error code (PAGE_FAULT_ERROR).
+ * @return 1 if the fault was resolved, 0 if it is a real fault.
+ */
+uint8_t vmm_page_fault(uint32_t virt_addr, uint32_t error) {
+    if (error & PF_RESERVED) return 0;
+
+    // User mode never reaches kernel memory
+    if (error & PF_USER && virt_addr >= 0xC0000000) return 0;
+
+    // A present page can only be written after copy-on-write
+    if (error & PF_PRESENT) return error & PF_WRITE ? cow_fault(virt_addr) : 0;
+
+    mm_t *mm = virt_addr >= 0xC0000000 ? &kernel_mm : current_mm;
+
+    vm_area_t *area = find_area(mm, virt_addr);
+
+    if (area == NULL || area->used == 0 || !(area->flags & VMA_DEMAND_PAGED)) return 0;
+
+    uint32_t fault_page = virt_addr & PTE_FRAME;
+
+    if (!fault_in(fault_page)) return 0;
+
+    uint32_t start = fault_page & ~(FAULT_AROUND_PAGES * PAGE_SIZE - 1);
+    uint32_t end = start + FAULT_AROUND_PAGES * PAGE_SIZE;
+
+    if (start < area->addr) start = area->addr;
+    if (end > area->addr + area->size) end = area->addr + area->size;
+
+    for (uint32_t addr = start; addr < end; addr += PAGE_SIZE) {
+        if (addr == fault_page || vmm_get_phys(addr) != 0) continue;
+
+        // Neighbouring pages are only an optimisation - stop when memory runs out
+        if (!fault_in(addr)) break;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Maps a range of kernel memory to newly allocated small pages.
+ *
+ * Physical pages are allocated in batches with pmm_alloc_bulk and each batch
+ * is mapped to consecutive virtual addresses with vmm_map_range.
+ *
+ * @param virt_addr The page aligned starting virtual address.
+ * @param pages The number of pages to map.
+ * @param migratetype The mobility of the pages (MIGRATE_TYPE).
+ * @return 1 if the range was mapped, 0 if physical memory ran out (the pages
+ *         mapped so far are left for the caller to free).
+ */
+static uint8_t map_small(uint32_t virt_addr, uint32_t pages, uint8_t migratetype) {
+    phys_addr_t frames[BATCH_PAGES];
+
+    while (pages > 0) {
+        uint32_t batch = pages < BATCH_PAGES ? pages : BATCH_PAGES;
+        uint32_t filled = pmm_alloc_bulk(batch, frames, migratetype);
+
+        if (filled < batch || !vmm_map_range(virt_addr, 0, frames, filled, 0x3)) {
+            if (filled > 0) pmm_free_bulk(filled, frames);
+
+            return 0;
+        }
+
+        virt_addr += batch * PAGE_SIZE;
+        pages -= batch;
+    }
+
+    return 1;
+}
 
 /**
- * @brief Retrieves the current page directory address from the CR3 register.
+ * @brief Maps 4 MiB of kernel memory to a single large page.
  *
- * @return The physical address of the current page directory.
+ * The page is an order MAX_ORDER buddy block, mapped by one global page
+ * directory entry marked PDE_ALLOCATED so that unmapping it frees the block.
+ *
+ * @param virt_addr The 4 MiB aligned virtual address.
+ * @param migratetype The mobility of the block (MIGRATE_TYPE).
+ * @return 1 if the large page was mapped, 0 if no 4 MiB block is free or a
+ *         page table is still installed for the address.
  */
-static uint32_t get_current_pd() {
-    uint32_t cr3;
-    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+static uint8_t map_large(uint32_t virt_addr, uint8_t migratetype) {
+    uint32_t pde_index = PDE_INDEX(virt_addr);
+
+    if (get_current_pd()->entries[pde_index] & PDE_PRESENT) return 0;
+
+    phys_addr_t phys_addr = pmm_malloc(LARGE_PAGE_SIZE, migratetype);
+
+    if (phys_addr == 0) return 0;
 
-    return cr3;
+    set_pde(pde_index, phys_addr | PDE_ALLOCATED | PDE_GLOBAL | PDE_PAGE_SIZE | PDE_PRESENT | PDE_READ_WRITE);
+
+    large_pages++;
+
+    return 1;
 }
 
 /**
- * @brief Creates and initializes a new page table.
+ * @brief Allocates virtual memory with physical page backing.
  *
- * This function allocates a 4 KiB page from physical memory to hold a new page
- * table. All 1024 entries are initialized to zero, marking them as not present.
+ * This function allocates a contiguous virtual memory region of @p length,
+ * rounded up to whole pages. Movable memory is only reached through its
+ * mapping, so only the address range is reserved and each page is backed by
+ * vmm_page_fault when it is first touched. Other memory is mapped to physical
+ * memory pages with read/write permissions (flags 0x3) up front. A region
+ * sized to a multiple of 4 MiB is placed 4 MiB aligned and each 4 MiB is
+ * backed by a large page, falling back to small pages where no 4 MiB block is
+ * free. Everything else is mapped with small pages by map_small.
  *
- * @return The physical address of the newly created page table.
+ * @param length The size of the memory region to allocate (in bytes).
+ * @param migratetype The mobility of the backing pages (MIGRATE_TYPE).
+ * @return Pointer to the starting virtual address of the allocated memory, or
+ *         NULL if virtual or physical memory allocation fails.
  */
-static uint32_t create_new_pt() {
-    uint32_t *pt_addr = pmm_malloc(PAGE_SIZE); // One page table fits in 4 KiB
+uint32_t *vmm_malloc(uint32_t length, uint8_t migratetype) {
+    length = (length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 
-    page_table_t *pt = (page_table_t *)(pt_addr + 0xC0000000);
+    uint8_t demand_paged = migratetype == MIGRATE_MOVABLE;
 
-    for (int i = 0; i < 1024; i++) {
-        pt->entries[i] = 0;
+    uint8_t large = !demand_paged && (length & (LARGE_PAGE_SIZE - 1)) == 0;
+
+    uint32_t *virt_addr = get_vm_area(&kernel_mm, length, large ? LARGE_PAGE_SIZE : PAGE_SIZE, demand_paged ? VMA_DEMAND_PAGED : 0);
+
+    if (virt_addr == NULL) return NULL; // TODO: implement better error handlng. page fault or call kswapd and retry?
+
+    if (demand_paged) return virt_addr;
+
+    uint8_t mapped = 1;
+
+    if (large) {
+        for (uint32_t addr = (uint32_t)virt_addr; mapped && addr < (uint32_t)virt_addr + length; addr += LARGE_PAGE_SIZE) {
+            if (map_large(addr, migratetype)) continue;
+
+            large_fallbacks++;
+            mapped = map_small(addr, LARGE_PAGE_SIZE / PAGE_SIZE, migratetype);
+        }
+    } else {
+        mapped = map_small((uint32_t)virt_addr, length / PAGE_SIZE, migratetype);
+    }
+
+    // Out of physical memory - release everything mapped so far
+    if (!mapped) {
+        vmm_free((uint32_t)virt_addr);
+
+        return NULL;
     }
     
-    return (uint32_t)pt_addr;
+    return virt_addr;
 }
 
 /**
- * @brief Splits a virtual memory area node into two separate nodes.
+ * @brief Frees previously allocated virtual memory and its physical backing.
  *
- * This function divides a virtual memory area node at @p length. The original
- * node is resized to @p length, and a new node is allocated with kmalloc and
- * sized to the remainder of the original size. The new node is inserted into
- * the linked list of virutal memory areas immediately after the original node.
+ * This function frees a virtual memory region by looking up the corresponding
+ * vm_area_t node in the tree, which gives the size of the region. The region
+ * is unmapped and its physical pages freed with vmm_unmap_range, pages of
+ * demand paged memory that were never touched are skipped. Only then is the
+ * node marked as unused and merged with adjacent free nodes, since merging
+ * frees nodes to the slab allocator, which may allocate the range again.
  *
- * @param node Pointer to the vm_area_t node to be split.
- * @param length The size of the node to be split off (in bytes).
+ * @param virt_addr The starting virtual address of the memory to free.
  */
-static void split(vm_area_t *node, uint32_t length) {
-    uint32_t *addr = kmalloc(sizeof(vm_area_t));
+void vmm_free(uint32_t virt_addr) {
+    vm_area_t *node = find_area(&kernel_mm, virt_addr);
 
-    // Create new node of size (original length - length)
-    vm_area_t *split = (vm_area_t *)addr;
-    split->addr = node->addr + length;
-    split->size = node->size - length;
-    split->used = 0;
-    split->next = node->next;
+    if (node == NULL || node->addr != virt_addr || node->used == 0) return;
 
-    node->size = length;
-    node->next = split;
+    vmm_unmap_range(virt_addr, node->size / PAGE_SIZE, 1);
+
+    node->used = 0;
+    merge(&kernel_mm, node);
+}
+
+/**
+ * @brief Prints virtual memory manager statistics.
+ */
+void vmm_dump() {
+    printf("Page tables: %d\n", pt_pages);
+    printf("Large pages: %d (fallbacks: %d)\n", large_pages, large_fallbacks);
+    printf("Linear map: %d MiB mapped in %d cycles\n", linear_end >> 20, linear_map_cycles);
+}
+
+/**
+ * @brief Checks the red-black and largest free area invariants of a subtree.
+ *
+ * @param node The root of the subtree (may be NULL).
+ * @param parent The expected parent of @p node.
+ * @return The black height of the subtree, or 0 if an invariant is broken.
+ */
+static uint32_t check_tree(vm_area_t *node, vm_area_t *parent) {
+    if (node == NULL) return 1;
+
+    if (node->parent != parent) return 0;
+    if (node->left != NULL && node->left->addr >= node->addr) return 0;
+    if (node->right != NULL && node->right->addr <= node->addr) return 0;
+
+    // A red node has no red children
+    if (node->color == RB_RED) {
+        if (node->left != NULL && node->left->color == RB_RED) return 0;
+        if (node->right != NULL && node->right->color == RB_RED) return 0;
+    }
+
+    uint32_t left = check_tree(node->left, node);
+    uint32_t right = check_tree(node->right, node);
+
+    if (left == 0 || left != right) return 0;
+
+    uint32_t max_free = node->used ? 0 : node->size;
+
+    if (subtree_max_free(node->left) > max_free) max_free = node->left->max_free;
+    if (subtree_max_free(node->right) > max_free) max_free = node->right->max_free;
+
+    if (node->max_free != max_free) return 0;
+
+    return left + (node->color == RB_BLACK);
 }
 
 /**
- * @brief Merges free virtual memory area nodes.
+ * @brief Measures the vm area tree under allocate and free churn.
  *
- * This function attempts to merge @p node with all consecutive unused nodes in
- * the linked list of virtual memory areas. Merging continues until a used node
- * is encountered or the end of the list is reached. Memory usesd by leftover
- * merged nodes is freed using kfree.
+ * Kernel areas of random size are reserved with get_vm_area, without mapping
+ * them, until @p areas are live, freeing a random live area every third step.
+ * Then @p areas more areas are freed and replaced at random. The cycles per
+ * operation are read from the time stamp counter. Afterwards the tree is
+ * checked for the red-black rules, the largest free area of every subtree and
+ * the address order of the neighbour links. Once every area is freed again,
+ * no free area may be left next to another free area, which only holds if
+ * each freed area was merged with its free neighbours.
  *
- * @param node Pointer to the starting vm_area_t node for merging.
+ * @param areas The number of live areas to build up.
  */
-static void merge(vm_area_t *node) {
-    vm_area_t *next = node->next;
+void vmm_tree_benchmark(uint32_t areas) {
+    if (areas == 0) return;
+
+    uint32_t *live = vmm_malloc(areas * sizeof(uint32_t), MIGRATE_UNMOVABLE);
+
+    if (live == NULL) return;
+
+    vm_area_t *first = kernel_mm.root;
+    while (first->left != NULL) first = first->left;
+
+    uint32_t nodes = 0;
+    for (vm_area_t *node = first; node != NULL; node = node->next) nodes++;
+
+    uint32_t count = 0;
+    uint32_t ops = 0;
+    uint32_t replaced = 0;
+    uint8_t full = 0;
+    uint32_t seed = 1;
+
+    uint64_t start;
+    __asm__ volatile("rdtsc" : "=A"(start));
+
+    while (replaced < areas) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t random = seed >> 8;
 
-    while (next != NULL) {
-        if (next->used == 1) {
-            return;
+        if (count == areas) full = 1;
+
+        if (count > 0 && (count == areas || random % 3 == 0)) {
+            uint32_t i = (random >> 4) % count;
+            vm_area_t *node = find_area(&kernel_mm, live[i]);
+
+            node->used = 0;
+            merge(&kernel_mm, node);
+
+            live[i] = live[--count];
+
+            if (full) replaced++;
+        } else {
+            uint32_t pages = random % 16 == 0 ? 1 + (random >> 4) % BENCHMARK_MAX_PAGES : 1 + (random >> 4) % 2;
+            void *addr = get_vm_area(&kernel_mm, pages * PAGE_SIZE, PAGE_SIZE, 0);
+
+            // Out of virtual address space or tree nodes
+            if (addr == NULL) break;
+
+            live[count++] = (uint32_t)addr;
         }
 
-        node->size = node->size + next->size;
-        next = next->next;
+        ops++;
+    }
+
+    uint64_t end;
+    __asm__ volatile("rdtsc" : "=A"(end));
+
+    if (ops == 0) ops = 1;
+
+    uint8_t valid = kernel_mm.root->color == RB_BLACK && check_tree(kernel_mm.root, NULL) != 0;
+
+    first = kernel_mm.root;
+    while (first->left != NULL) first = first->left;
+
+    // Neighbour links must follow the address order without gaps
+    for (vm_area_t *node = first; node->next != NULL; node = node->next) {
+        if (node->next->prev != node || node->addr + node->size != node->next->addr) valid = 0;
+    }
+
+    printf("%d live areas: %d cycles per operation over %d operations, tree %s\n",
+           count, (uint32_t)(end - start) / ops, ops, valid ? "valid" : "broken");
+
+    while (count > 0) {
+        vm_area_t *node = find_area(&kernel_mm, live[--count]);
 
-        kfree(next, sizeof(vm_area_t));
+        node->used = 0;
+        merge(&kernel_mm, node);
     }
+
+    first = kernel_mm.root;
+    while (first->left != NULL) first = first->left;
+
+    uint32_t left = 0;
+    uint32_t unmerged = 0;
+
+    for (vm_area_t *node = first; node != NULL; node = node->next) {
+        left++;
+
+        if (node->next != NULL && !node->used && !node->next->used) unmerged++;
+    }
+
+    printf("Nodes before %d, after freeing every area %d, %d free neighbours left unmerged\n", nodes, left, unmerged);
+
+    vmm_free((uint32_t)live);
 }
 
 /**
- * @brief Finds and allocates a virtual memory area of the requested size.
+ * @brief Measures mapping a 4 MiB buffer page by page and in bulk.
  *
- * This function searches the linked list of virtual memory areas for an unused
- * region that can accommodate the requested length. If a larger region is
- * found, it is split to match the exact size needed. The found region is
- * marked as used and its address is returned.
+ * Each run reserves a MAP_BENCHMARK_SIZE area twice and maps it with small
+ * pages. The first time every page is allocated with pmm_malloc and mapped
+ * with vmm_map, then unmapped with vmm_unmap and freed with pmm_free one page
+ * at a time. The second time the pages are allocated and mapped in batches by
+ * map_small, then unmapped and freed in batches by vmm_free. The cycles per
+ * page to map and to free are read from the time stamp counter and averaged
+ * over @p runs.
  *
- * @param length The size of the virtual memory area needed (in bytes).
- * @return Pointer to the starting address of the allocated virtual memory area,
- *         or NULL if no suitable area is found.
+ * @param runs The number of times each way is measured.
  */
-static void *get_vm_area(uint32_t length) {
-    vm_area_t *node = head;
+void vmm_map_benchmark(uint32_t runs) {
+    uint32_t pages = MAP_BENCHMARK_SIZE / PAGE_SIZE;
+    uint32_t cycles[2][2] = {{0, 0}, {0, 0}};
 
-    while (node != NULL) {
-        if (node->used == 1 || node->size < length) {
-            node = node->next;
-            continue;
-        }
+    if (runs == 0) return;
+
+    for (uint32_t i = 0; i < runs; i++) {
+        for (int bulk = 0; bulk < 2; bulk++) {
+            uint32_t addr = (uint32_t)get_vm_area(&kernel_mm, MAP_BENCHMARK_SIZE, PAGE_SIZE, 0);
+
+            if (addr == 0) return;
 
-        // Split if a larger than needed node is found
-        if (node->size > length) split(node, length);
-        
-        node->used = 1;
+            uint8_t mapped = 1;
 
-        return (uint32_t *)node->addr;
+            uint64_t start;
+            __asm__ volatile("rdtsc" : "=A"(start));
+
+            if (bulk) {
+                mapped = map_small(addr, pages, MIGRATE_MOVABLE);
+            } else {
+                for (uint32_t page = 0; mapped && page < pages; page++) {
+                    phys_addr_t phys_addr = pmm_malloc(PAGE_SIZE, MIGRATE_MOVABLE);
+
+                    mapped = phys_addr != 0 && vmm_map(addr + page * PAGE_SIZE, phys_addr, 0x3);
+
+                    if (phys_addr != 0 && !mapped) pmm_free(phys_addr);
+                }
+            }
+
+            uint64_t middle;
+            __asm__ volatile("rdtsc" : "=A"(middle));
+
+            if (!bulk) {
+                for (uint32_t page = 0; page < pages; page++) {
+                    phys_addr_t phys_addr = vmm_unmap(addr + page * PAGE_SIZE);
+
+                    if (phys_addr != 0) pmm_free(phys_addr);
+                }
+            }
+
+            // Unmaps what is left and releases the area
+            vmm_free(addr);
+
+            uint64_t end;
+            __asm__ volatile("rdtsc" : "=A"(end));
+
+            if (!mapped) {
+                printf("vmm_map_benchmark: out of memory\n");
+                return;
+            }
+
+            cycles[bulk][0] += (uint32_t)(middle - start) / pages;
+            cycles[bulk][1] += (uint32_t)(end - middle) / pages;
+        }
     }
-    
-    return NULL;
+
+    printf("4 MiB buffer, cycles per page: map %d, free %d page by page; map %d, free %d in bulk\n",
+           cycles[0][0] / runs, cycles[0][1] / runs, cycles[1][0] / runs, cycles[1][1] / runs);
 }
 
 /**
- * @brief Initializes the virtual memory manager.
+ * @brief Measures walking the linear map through large and small pages.
  *
- * This function sets up the virtual memory managemer by creating the initial
- * linked list of vm_area_t nodes. It reserves one 4 KiB node for slab allocator
- * initialization and creates a second node for the remaining virtual address
- * space from @p virt_addr_base to 0xFFFFFFFF. Both nodes are initially marked
- * as unused.
+ * Up to LINEAR_BENCHMARK_SIZE bytes of physical memory from address 0 are
+ * read one word per page, first through the linear map at 0xC0000000, where
+ * one TLB entry covers a whole large page, and then through a second mapping
+ * of the same memory made of 4 KiB pages, which needs one TLB entry per page.
+ * The span is far larger than the TLB, so the second walk takes a TLB miss on
+ * every page. The cycles per page read are read from the time stamp counter.
+ * The 4 KiB mapping is removed afterwards without freeing the memory.
  *
- * @param virt_addr_base The starting virtual address for the managed memory
- *        region.
+ * @param passes The number of walks over the span per mapping.
  */
-void vmm_init(uint32_t virt_addr_base) {
-    uint32_t length = 0xFFFFFFFF - virt_addr_base;
+void vmm_linear_benchmark(uint32_t passes) {
+    uint32_t span = (linear_end < LINEAR_BENCHMARK_SIZE ? linear_end : LINEAR_BENCHMARK_SIZE) & ~(LARGE_PAGE_SIZE - 1);
+    uint32_t pages = span / PAGE_SIZE;
+    uint32_t cycles[2];
 
-    // Allocate a page for inital linked list node
-    uint32_t addr = (uint32_t)pmm_malloc(PAGE_SIZE);
+    if (passes == 0 || pages == 0) return;
 
-    // Pre-split 9 4 KiB nodes - these will be used to initialize the slab allocator
-    for (int i = 0; i < 9; i++) {
-        vm_area_t *page_node = (vm_area_t *)(addr + 0xC0000000);
-        page_node->addr = virt_addr_base;
-        page_node->size = PAGE_SIZE;
-        page_node->used = 0;
-        page_node->next = NULL;
+    uint32_t small = (uint32_t)get_vm_area(&kernel_mm, span, PAGE_SIZE, 0);
 
-        addr += sizeof(vm_area_t);
-        virt_addr_base += PAGE_SIZE;
-        length -= PAGE_SIZE;
+    if (small == 0) return;
 
-        // Insert node at tail
-        if (head == NULL) {
-            head = page_node;
-            continue;
-        }
-        vm_area_t *curr = head;
-        while (curr->next != NULL) {
-            curr = curr->next;
+    // The 4 KiB mapping points at the memory the linear map already covers
+    uint8_t mapped = vmm_map_range(small, 0, NULL, pages, 0x3);
+
+    for (int run = 0; mapped && run < 2; run++) {
+        volatile uint32_t *base = (volatile uint32_t *)(run == 0 ? 0xC0000000 : small);
+        uint32_t sum = 0;
+
+        uint64_t start;
+        __asm__ volatile("rdtsc" : "=A"(start));
+
+        for (uint32_t pass = 0; pass < passes; pass++) {
+            for (uint32_t page = 0; page < pages; page++) sum += base[page * (PAGE_SIZE / sizeof(uint32_t))];
         }
-        curr->next = page_node;
+
+        uint64_t end;
+        __asm__ volatile("rdtsc" : "=A"(end));
+
+        cycles[run] = (uint32_t)(end - start) / passes / pages;
+
+        // Keep the reads from being optimised away
+        __asm__ volatile("" : : "r"(sum));
     }
 
-    // Create a node for the rest of the virtual memory area
-    vm_area_t *node = (vm_area_t *)(addr + 0xC0000000);
-    node->addr = virt_addr_base;
-    node->size = length;
+    // The pages belong to the linear map - unmap without freeing them
+    vmm_unmap_range(small, pages, 0);
+
+    vm_area_t *node = find_area(&kernel_mm, small);
+
     node->used = 0;
-    node->next = NULL;
+    merge(&kernel_mm, node);
+
+    if (!mapped) return;
+
+    printf("Linear map walk over %d MiB: %d cycles per page with large pages, %d with 4 KiB pages\n",
+           span >> 20, cycles[0], cycles[1]);
+}
+
+/**
+ * @brief Drops a reference to a mapped page.
+ *
+ * @param phys_addr The physical address of the page.
+ * @return 1 if no other address space maps the page and it can be freed, 0
+ *         otherwise.
+ */
+static uint8_t put_page(phys_addr_t phys_addr) {
+    page_t *page = pmm_get_page(phys_addr);
 
-    // Insert node at tail
-    vm_area_t *curr = head;
-    while (curr->next != NULL) {
-        curr = curr->next;
+    if (page->refcount > 1) {
+        page->refcount--;
+        return 0;
     }
-    curr->next = node;
+
+    return 1;
 }
 
 /**
- * @brief Maps a virtual address to a physical address in the page tables.
+ * @brief Allocates an address space with no user mappings.
  *
- * This function establishes a mapping between @p virt_addr and @p phys_addr by
- * updating the appropriate page directory and page table entries. If the
- * required page table does not exist, it is created automatically. The function
- * does not overwrite existing mappings if the page is already present.
+ * The page directory is a kernel page of its own (PD_PAGES pages under PAE).
+ * It gets a copy of the kernel half of the current page directory and maps
+ * itself in its last entries. Under PAE the page directories are listed in a
+ * free PDPT of the pool in the kernel image. The address space is added to the
+ * list of address spaces, so it receives every later change to the kernel half.
  *
- * @param virt_addr The virtual address to be mapped.
- * @param phys_addr The physical address to map to.
- * @param flags Page table flags.
+ * @return Pointer to the address space, or NULL if memory ran out.
  */
-void vmm_map(uint32_t virt_addr, uint32_t phys_addr, uint32_t flags) {
-    uint32_t pde_index = (virt_addr >> 22) & 0x3FF;
-    uint32_t pte_index = (virt_addr >> 12) & 0x3FF;
+static mm_t *mm_alloc() {
+    mm_t *mm = kmalloc(sizeof(mm_t));
 
-    page_directory_t *pd = (page_directory_t *)get_current_pd();
+    if (mm == NULL) return NULL;
 
-    // Check if page table exists
-    if (!(pd->entries[pde_index] & PDE_PRESENT)) {
-        pd->entries[pde_index] = create_new_pt() | flags;
+#ifdef CONFIG_PAE
+    // A PDPT is free while its first entry is clear
+    uint32_t slot = 0;
+
+    while (slot < MAX_ADDRESS_SPACES && pdpts[slot][0] != 0) slot++;
+
+    if (slot == MAX_ADDRESS_SPACES) {
+        kfree(mm);
+        return NULL;
     }
-    
-    // Get the physical address from the (possibly updated) PDE
-    uint32_t pt_phys_addr = pd->entries[pde_index] & 0xFFFFF000;
-    page_table_t *pt = (page_table_t *)(pt_phys_addr + 0xC0000000);
-    
-    // Check if address is already mapped
-    if (!(pt->entries[pte_index] & PTE_PRESENT)) {
-        pt->entries[pte_index] = phys_addr | flags;
+
+    mm->pdpt = pdpts[slot];
+#endif
+
+    mm->pd = (page_directory_t *)vmm_malloc(PD_PAGES * PAGE_SIZE, MIGRATE_UNMOVABLE);
+
+    if (mm->pd == NULL) {
+        kfree(mm);
+        return NULL;
+    }
+
+    mm->root = NULL;
+
+    page_directory_t *pd = get_current_pd();
+
+    for (uint32_t i = 0; i < KERNEL_PDE; i++) {
+        mm->pd->entries[i] = 0;
+    }
+
+    for (uint32_t i = KERNEL_PDE; i < PDE_SELF; i++) {
+        mm->pd->entries[i] = pd->entries[i];
+    }
+
+    for (uint32_t i = 0; i < PD_PAGES; i++) {
+        phys_addr_t pd_addr = vmm_get_phys((uint32_t)mm->pd + i * PAGE_SIZE);
+
+        mm->pd->entries[PDE_SELF + i] = pd_addr | PDE_PRESENT | PDE_READ_WRITE;
+
+#ifdef CONFIG_PAE
+        mm->pdpt[i] = pd_addr | PDE_PRESENT;
+#endif
     }
+
+#ifdef CONFIG_PAE
+    mm->cr3 = (uint32_t)mm->pdpt - 0xC0000000;
+#else
+    mm->cr3 = vmm_get_phys((uint32_t)mm->pd);
+#endif
+
+    mm->next = mm_list;
+    mm_list = mm;
+
+    return mm;
 }
 
 /**
- * @brief Unmaps a virtual address and returns its physical address.
+ * @brief Creates an empty address space.
  *
- * This function removes the mapping for @p virt_addr by clearing the
- * corresponding page table entry. The physical address mapped to @p virt_addr
- * is extracted and returned before the entry is cleared.
+ * A single free vm area covers the user half from USER_BASE to 0xC0000000.
  *
- * @param virt_addr The virtual address to be unmapped.
- * @return The physical address that was previously mapped to the virtual
- *         address.
+ * @return Pointer to the address space, or NULL if memory ran out.
  */
-uint32_t vmm_unmap(uint32_t virt_addr) {
-    uint32_t pde_index = (virt_addr >> 22) & 0x3FF;
-    uint32_t pte_index = (virt_addr >> 12) & 0x3FF;
+mm_t *mm_create() {
+    mm_t *mm = mm_alloc();
 
-    page_directory_t *pd = (page_directory_t *)get_current_pd();
-    uint32_t pde = pd->entries[pde_index];
+    if (mm == NULL) return NULL;
 
-    uint32_t pt_phys_addr = pde & PDE_FRAME;
-    page_table_t *pt = (page_table_t *)(pt_phys_addr + 0xC0000000);
+    vm_area_t *node = alloc_node();
 
-    uint32_t phys_addr = pt->entries[pte_index] & PTE_FRAME;
-    pt->entries[pte_index] = 0;
+    if (node == NULL) {
+        mm_destroy(mm);
+        return NULL;
+    }
 
-    return phys_addr;
+    node->addr = USER_BASE;
+    node->size = 0xC0000000 - USER_BASE;
+    node->used = 0;
+
+    insert_after(mm, NULL, node);
+
+    return mm;
 }
 
 /**
- * @brief Allocates virtual memory with physical page backing.
+ * @brief Shares the pages of a page table with a copy of it.
  *
- * This function allocates a contiguous virtual memory region of @p length and
- * maps it to physical memory pages. Physical pages are allocated in 4 KiB
- * chunks and mapped to consecutive virtual addresses with read/write
- * permissions (flags 0x3). The allocation is performed page by page until the
- * requested length is satisfied.
+ * Every present page gains a reference. Writable pages are write protected
+ * and marked PTE_COW in both page tables, so the first write from either
+ * side copies the page. The copy is written through the KMAP_PAGE_TABLE slot.
  *
- * @param length The size of the memory region to allocate (in bytes).
- * @return Pointer to the starting virtual address of the allocated memory, or
- *         NULL if virtual memory allocation fails.
+ * @param pt The page table of the current address space.
+ * @param copy_addr The physical address of the zeroed copy.
+ * @return The number of live entries in the copy.
  */
-uint32_t *vmm_malloc(uint32_t length) {
-    uint32_t *virt_addr = get_vm_area(length);
+static uint32_t share_pt(page_table_t *pt, phys_addr_t copy_addr) {
+    pte_t *copy = vmm_kmap(copy_addr, KMAP_PAGE_TABLE);
+    uint32_t live = 0;
 
-    if (virt_addr == NULL) return NULL; // TODO: implement better error handlng. page fault or call kswapd and retry?
+    for (int i = 0; i < PT_ENTRIES; i++) {
+        pte_t pte = pt->entries[i];
 
-    uint32_t *curr_virt_addr = virt_addr;
+        if (!(pte & PTE_PRESENT)) continue;
 
-    while (length >= PAGE_SIZE) {
-        uint32_t *phys_addr = pmm_malloc(PAGE_SIZE);
-        
-        vmm_map((uint32_t)curr_virt_addr, (uint32_t)phys_addr, 0x3);
-        
-        curr_virt_addr += PAGE_SIZE;
-        length -= PAGE_SIZE;
-    }    
-    
-    return virt_addr;
+        if (pte & PTE_READ_WRITE) {
+            pte = (pte & ~PTE_READ_WRITE) | PTE_COW;
+            pt->entries[i] = pte;
+        }
+
+        pmm_get_page(pte & PTE_ADDR)->refcount++;
+
+        copy[i] = pte;
+        live++;
+    }
+
+    vmm_kunmap(KMAP_PAGE_TABLE);
+
+    return live;
 }
 
 /**
- * @brief Frees previously allocated virtual memory and its physical backing.
+ * @brief Creates a copy-on-write copy of the current address space.
  *
- * This function frees a virtual memory region by marking the corresponding
- * vm_area_t node as unused and merging it with adjacent free nodes. Each page
- * is unmapped and the associated physical memory freed. Like the allocation
- * process, deallocation is performed in 4 KiB page increments.
+ * The user vm areas are copied, and each user page table is copied with its
+ * pages shared by share_pt, so no page is copied until it is written. The
+ * TLB entries of the now write protected user pages are flushed. Cloning the
+ * kernel address space gives an empty address space.
  *
- * @param virt_addr The starting virtual address of the memory to free.
- * @param length The size of the memory region to free (in bytes).
+ * @return Pointer to the new address space, or NULL if memory ran out.
  */
-void vmm_free(uint32_t virt_addr, uint32_t length) {
-    vm_area_t *node = head;
+mm_t *mm_clone() {
+    if (current_mm == &kernel_mm) return mm_create();
 
-    while (node != NULL) {
-        if (node->addr == virt_addr) {
-            node->used = 0;
-            merge(node);
+    mm_t *mm = mm_alloc();
+
+    if (mm == NULL) return NULL;
+
+    vm_area_t *area = current_mm->root;
+    vm_area_t *prev = NULL;
+
+    while (area->left != NULL) area = area->left;
+
+    for (; area != NULL; area = area->next) {
+        vm_area_t *node = alloc_node();
+
+        if (node == NULL) {
+            mm_destroy(mm);
+            return NULL;
+        }
+
+        node->addr = area->addr;
+        node->size = area->size;
+        node->used = area->used;
+        node->flags = area->flags;
+
+        insert_after(mm, prev, node);
+        prev = node;
+    }
+
+    page_directory_t *pd = get_current_pd();
+    uint8_t shared = 0;
+
+    for (uint32_t pde_index = 0; pde_index < KERNEL_PDE; pde_index++) {
+        pte_t pde = pd->entries[pde_index];
+
+        if (!(pde & PDE_PRESENT)) continue;
+
+        phys_addr_t pt_addr = create_new_pt();
+
+        if (pt_addr == 0) {
+            mm_destroy(mm);
+            mm = NULL;
+            break;
+        }
+
+        mm->pd->entries[pde_index] = pt_addr | (pde & ~PTE_ADDR);
+        pmm_get_page(pt_addr)->private = share_pt(get_pt(pde_index), pt_addr);
+
+        shared = 1;
+    }
+
+    // User pages are not global - reloading CR3 flushes them
+    if (shared) __asm__ volatile("mov %%cr3, %%eax; mov %%eax, %%cr3" : : : "eax", "memory");
+
+    return mm;
+}
+
+/**
+ * @brief Loads an address space into CR3.
+ *
+ * Kernel pages are global and stay in the TLB.
+ *
+ * @param mm The address space to switch to.
+ */
+void mm_switch(mm_t *mm) {
+    current_mm = mm;
+
+    __asm__ volatile("mov %0, %%cr3" : : "r"(mm->cr3) : "memory");
+}
+
+/**
+ * @brief Frees an address space that is not loaded.
+ *
+ * Every user page loses a reference and is freed if no other address space
+ * maps it. The user page tables are read through the KMAP_PAGE_TABLE slot and
+ * freed, then the vm areas and the page directory. The kernel address space
+ * and the current address space cannot be destroyed.
+ *
+ * @param mm The address space to free.
+ */
+void mm_destroy(mm_t *mm) {
+    if (mm == &kernel_mm || mm == current_mm) return;
+
+    mm_t **link = &mm_list;
+
+    while (*link != mm) link = &(*link)->next;
+    *link = mm->next;
+
+    for (uint32_t pde_index = 0; pde_index < KERNEL_PDE; pde_index++) {
+        pte_t pde = mm->pd->entries[pde_index];
+
+        if (!(pde & PDE_PRESENT)) continue;
+
+        pte_t *pt = vmm_kmap(pde & PTE_ADDR, KMAP_PAGE_TABLE);
+
+        for (int i = 0; i < PT_ENTRIES; i++) {
+            if (pt[i] & PTE_PRESENT && put_page(pt[i] & PTE_ADDR)) pmm_free(pt[i] & PTE_ADDR);
         }
 
-        node = node->next;
+        vmm_kunmap(KMAP_PAGE_TABLE);
+
+        pmm_free(pde & PTE_ADDR);
+        pt_pages--;
     }
 
-    while (length >= PAGE_SIZE) {
-        uint32_t phys_addr = vmm_unmap(virt_addr);
+    vm_area_t *area = mm->root;
 
-        pmm_free(phys_addr, PAGE_SIZE);
+    while (area != NULL && area->left != NULL) area = area->left;
 
-        virt_addr += PAGE_SIZE;
-        length -= PAGE_SIZE;
+    while (area != NULL) {
+        vm_area_t *next = area->next;
+
+        kfree(area);
+        area = next;
     }
+
+#ifdef CONFIG_PAE
+    mm->pdpt[0] = 0;
+#endif
+
+    vmm_free((uint32_t)mm->pd);
+    kfree(mm);
+}
+
+/**
+ * @brief Allocates user memory in the current address space.
+ *
+ * Only the address range is reserved, each page is backed by vmm_page_fault
+ * when it is first touched.
+ *
+ * @param length The size of the memory region to allocate (in bytes).
+ * @return Pointer to the starting virtual address of the allocated memory, or
+ *         NULL if no user address range is free.
+ */
+uint32_t *mm_malloc(uint32_t length) {
+    // The kernel address space has no user half
+    if (current_mm == &kernel_mm) return NULL;
+
+    length = (length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    return get_vm_area(current_mm, length, PAGE_SIZE, VMA_DEMAND_PAGED);
+}
+
+/**
+ * @brief Frees user memory of the current address space.
+ *
+ * Like vmm_free, the region is unmapped before its area is merged, since
+ * merging frees nodes to the slab allocator.
+ *
+ * @param virt_addr The starting virtual address of the memory to free.
+ */
+void mm_free(uint32_t virt_addr) {
+    vm_area_t *node = find_area(current_mm, virt_addr);
+
+    if (node == NULL || node->addr != virt_addr || node->used == 0) return;
+
+    vmm_unmap_range(virt_addr, node->size / PAGE_SIZE, 1);
+
+    node->used = 0;
+    merge(current_mm, node);
 }
\ No newline at end of file